@@ -0,0 +1,331 @@
+/* microbenchmarks of the kernels of markdown.cpp, which is included
+ * for its static functions.
+ *
+ *    $ make bench-kernels
+ *    $ ./mkdown-kernels [--size=CHARS] [--samples=N] [KERNEL...]
+ *
+ * each kernel runs over inputs of several distributions of markup
+ * characters, line lengths and non-ascii characters, and reports the
+ * mean time per utf-8 byte with a 95% confidence interval of the
+ * student t distribution, and the median of the samples.
+ */
+#include "markdown.cpp"
+#include "tools.hpp"
+#include <random>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+struct distribution_type {
+    char const* name;
+    double special;         // share of markup characters
+    double line;            // mean line length
+    double unicode;         // share of non-ascii characters
+};
+
+static const distribution_type distribution[]{
+    {"plain", 0.02, 72, 0.0},
+    {"dense", 0.25, 72, 0.0},
+    {"short", 0.05, 16, 0.0},
+    {"long", 0.05, 400, 0.0},
+    {"unicode", 0.05, 72, 0.3},
+};
+
+/* words of latin letters, markup characters, han and latin-1 letters,
+ * from a fixed seed.
+ */
+static std::wstring
+make_input (distribution_type const& d, std::size_t size)
+{
+    static const std::wstring special (L"*_`[]()<>&\\#!-.\"'");
+    std::mt19937 rng (20261018);
+    std::uniform_real_distribution<double> u (0.0, 1.0);
+    std::wstring input;
+    while (input.size () < size) {
+        double x = u (rng);
+        if (x < 1.0 / d.line)
+            input.push_back ('\n');
+        else if (u (rng) < d.special)
+            input.push_back (special[rng () % special.size ()]);
+        else if (u (rng) < d.unicode)
+            input.push_back (rng () % 2 ? 0x4e00 + rng () % 0x5000
+                : 0xc0 + rng () % 0x40);
+        else if (u (rng) < 0.18)
+            input.push_back (' ');
+        else
+            input.push_back ('a' + rng () % 26);
+    }
+    input.push_back ('\n');
+    return input;
+}
+
+typedef std::size_t (*kernel_function) (std::wstring const& input,
+    std::wostream& output);
+
+/* calls f with the lines of input */
+template <typename F>
+static std::size_t
+each_line (std::wstring const& input, F f)
+{
+    std::size_t n = 0;
+    char_iterator const eos = input.cend ();
+    for (char_iterator s = input.cbegin (); s < eos; ) {
+        char_iterator e = std::find (s, eos, '\n');
+        n += f (s, e);
+        s = e + 1;
+    }
+    return n;
+}
+
+/* calls f at each c of input */
+template <typename F>
+static std::size_t
+each_of (std::wstring const& input, wchar_t c, F f)
+{
+    std::size_t n = 0;
+    char_iterator const eos = input.cend ();
+    for (char_iterator s = input.cbegin ();
+            (s = std::find (s, eos, c)) < eos; ++s)
+        n += f (s, eos);
+    return n;
+}
+
+static std::size_t
+kernel_scan_of_char (std::wstring const& input, std::wostream&)
+{
+    std::size_t n = 0;
+    char_iterator const eos = input.cend ();
+    for (char_iterator s = input.cbegin (); s < eos; ++n) {
+        char_iterator e = scan_of (s, eos, 1, -1, ' ');
+        s = s < e ? e : s + 1;
+    }
+    return n;
+}
+
+static std::size_t
+kernel_scan_of_predicate (std::wstring const& input, std::wostream&)
+{
+    std::size_t n = 0;
+    char_iterator const eos = input.cend ();
+    for (char_iterator s = input.cbegin (); s < eos; ++n) {
+        char_iterator e = scan_of (s, eos, 1, -1, ismdprint);
+        s = s < e ? e : s + 1;
+    }
+    return n;
+}
+
+static std::size_t
+kernel_rscan_of_char (std::wstring const& input, std::wostream&)
+{
+    return each_line (input, [](char_iterator s, char_iterator e) {
+        std::size_t n = 0;
+        while (s < e) {
+            char_iterator p = rscan_of (s, e, 'a');
+            e = p < e ? p : e - 1;
+            ++n;
+        }
+        return n;
+    });
+}
+
+static std::size_t
+kernel_rscan_of_predicate (std::wstring const& input, std::wostream&)
+{
+    return each_line (input, [](char_iterator s, char_iterator e) {
+        return std::size_t (e - rscan_of (s, e, ismdprint));
+    });
+}
+
+static std::size_t
+kernel_scan_quoted (std::wstring const& input, std::wostream&)
+{
+    return each_of (input, '[', [](char_iterator s, char_iterator e) {
+        return std::size_t (scan_quoted (s, e, '[', ']', '\\', ismdprint) - s);
+    });
+}
+
+static std::size_t
+kernel_scan_htmltag (std::wstring const& input, std::wostream&)
+{
+    std::wstring tagname;
+    return each_of (input, '<', [&tagname](char_iterator s, char_iterator e) {
+        return std::size_t (scan_htmltag (s, e, tagname) - s);
+    });
+}
+
+static std::size_t
+kernel_check_html5entity (std::wstring const& input, std::wostream&)
+{
+    return each_of (input, '&', [](char_iterator s, char_iterator e) {
+        return std::size_t (check_html5entity (s, e));
+    });
+}
+
+static std::size_t
+kernel_decode_linkid (std::wstring const& input, std::wostream&)
+{
+    return each_line (input, [](char_iterator s, char_iterator e) {
+        return decode_linkid (s, e).size ();
+    });
+}
+
+static std::size_t
+kernel_print_with_escape_html (std::wstring const& input, std::wostream& output)
+{
+    print_with_escape_html (input.cbegin (), input.cend (), output);
+    return 0;
+}
+
+static std::size_t
+kernel_print_with_escape_htmlall (std::wstring const& input,
+    std::wostream& output)
+{
+    print_with_escape_htmlall (input.cbegin (), input.cend (), output);
+    return 0;
+}
+
+static std::size_t
+kernel_print_with_escape_uri (std::wstring const& input, std::wostream& output)
+{
+    return each_line (input, [&output](char_iterator s, char_iterator e) {
+        print_with_escape_uri (s, e, output);
+        return std::size_t (0);
+    });
+}
+
+static std::size_t
+kernel_split_lines (std::wstring const& input, std::wostream& output)
+{
+    markdown_sink sink {&output};
+    markdown_options options;
+    document_type doc {{}, sink, options, {}, {}, true};
+    alloc_begin (doc);
+    tokens_type lines;
+    split_lines (input.cbegin (), input.cend (), lines, doc);
+    return lines.size ();
+}
+
+struct kernel_type {
+    char const* name;
+    kernel_function f;
+};
+
+static const kernel_type kernel[]{
+    {"scan_of/char", kernel_scan_of_char},
+    {"scan_of/predicate", kernel_scan_of_predicate},
+    {"rscan_of/char", kernel_rscan_of_char},
+    {"rscan_of/predicate", kernel_rscan_of_predicate},
+    {"scan_quoted", kernel_scan_quoted},
+    {"scan_htmltag", kernel_scan_htmltag},
+    {"check_html5entity", kernel_check_html5entity},
+    {"decode_linkid", kernel_decode_linkid},
+    {"print_with_escape_html", kernel_print_with_escape_html},
+    {"print_with_escape_htmlall", kernel_print_with_escape_htmlall},
+    {"print_with_escape_uri", kernel_print_with_escape_uri},
+    {"split_lines", kernel_split_lines},
+};
+
+/* seconds of reps calls */
+static double
+run_kernel (kernel_function f, std::wstring const& input, std::size_t reps,
+    std::size_t& sum)
+{
+    nullbuf_type buf;
+    std::wostream output (&buf);
+    auto t0 = std::chrono::steady_clock::now ();
+    for (std::size_t i = 0; i < reps; ++i)
+        sum += f (input, output);
+    auto t1 = std::chrono::steady_clock::now ();
+    sum += buf.size;
+    return std::chrono::duration<double> (t1 - t0).count ();
+}
+
+/* samples of ns per byte, with the reps of each taking 5ms at least */
+static std::vector<double>
+measure (kernel_function f, std::wstring const& input, int samples,
+    std::size_t& sum)
+{
+    double bytes = utf8_size (input);
+    std::size_t reps = 1;
+    while (run_kernel (f, input, reps, sum) < 0.005 && reps < (1u << 20))
+        reps *= 2;
+    std::vector<double> ns;
+    for (int i = 0; i < samples; ++i)
+        ns.push_back (run_kernel (f, input, reps, sum) * 1e9 / (reps * bytes));
+    return ns;
+}
+
+/* two-sided 95% quantile of the student t distribution, from a table
+ * to 30 degrees of freedom and by a cornish-fisher expansion beyond
+ */
+static double
+student_t95 (int df)
+{
+    static const double table[]{
+        12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+        2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+    };
+    if (df <= 30)
+        return table[df - 1];
+    double z = 1.959964;
+    double z3 = z * z * z;
+    return z + (z3 + z) / (4.0 * df)
+        + (5 * z3 * z * z + 16 * z3 + 3 * z) / (96.0 * df * df);
+}
+
+static bool
+selected (char const* name, std::deque<std::string> const& only)
+{
+    if (only.empty ())
+        return true;
+    for (auto& x : only)
+        if (std::strstr (name, x.c_str ()))
+            return true;
+    return false;
+}
+
+int main (int argc, char* argv[])
+{
+    std::size_t size = 1 << 16;
+    int samples = 10;
+    std::deque<std::string> only;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strncmp (argv[i], "--size=", 7) == 0)
+            size = std::strtoul (argv[i] + 7, nullptr, 10);
+        else if (std::strncmp (argv[i], "--samples=", 10) == 0)
+            samples = std::max (2, std::atoi (argv[i] + 10));
+        else if (std::strncmp (argv[i], "--", 2) != 0)
+            only.push_back (argv[i]);
+        else {
+            std::fprintf (stderr, "usage: mkdown-kernels [--size=CHARS]"
+                " [--samples=N] [KERNEL...]\n");
+            return EXIT_FAILURE;
+        }
+    }
+    std::deque<std::wstring> input;
+    for (auto& d : distribution)
+        input.push_back (make_input (d, size));
+    std::size_t sum = 0;
+    std::printf ("%-26s %-8s %9s %8s %9s\n",
+        "kernel", "input", "ns/byte", "+-95%", "median");
+    for (auto& k : kernel) {
+        if (! selected (k.name, only))
+            continue;
+        for (std::size_t j = 0; j < input.size (); ++j) {
+            std::vector<double> ns = measure (k.f, input[j], samples, sum);
+            double mean = 0, var = 0;
+            for (double x : ns)
+                mean += x / ns.size ();
+            for (double x : ns)
+                var += (x - mean) * (x - mean) / (ns.size () - 1);
+            std::sort (ns.begin (), ns.end ());
+            std::printf ("%-26s %-8s %9.3f %8.3f %9.3f\n",
+                k.name, distribution[j].name, mean,
+                student_t95 (ns.size () - 1) * std::sqrt (var / ns.size ()),
+                ns[ns.size () / 2]);
+        }
+    }
+    return sum == 0;
+}
@@ -0,0 +1,269 @@
+/* A/B comparison of two builds of mkdown, or of saved runs of them.
+ *
+ *    $ ./mkdown-compare [--runs=N] [--threshold=PERCENT] [--save=FILE]
+ *          A B CORPUS...
+ *
+ * A and B are executables filtering stdin to stdout, or json files of
+ * runs saved by --save. builds run on each CORPUS in turns, A and B
+ * interleaved in alternating order, and each run counts the cpu time
+ * of the child. --save writes the runs of B as a baseline for later.
+ *
+ * for each corpus, the delta of the medians of B from A is reported
+ * with a bootstrap 95% confidence interval and the p-value of the
+ * Mann-Whitney U test. a delta beyond the threshold with p < 0.05 is
+ * a regression, and the exit status is 1 if there is any.
+ */
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+typedef std::map<std::string, std::vector<double>> runs_type;
+
+/* a build to run, or the runs of a saved one */
+struct side_type {
+    std::string name;
+    bool saved;
+    runs_type runs;         // cpu seconds by corpus
+};
+
+static bool
+isjson (std::string const& path)
+{
+    std::size_t n = path.size ();
+    return n > 5 && path.compare (n - 5, 5, ".json") == 0;
+}
+
+static std::string
+corpus_name (std::string const& path)
+{
+    std::size_t slash = path.rfind ('/');
+    return std::string::npos == slash ? path : path.substr (slash + 1);
+}
+
+/* cpu seconds of build < corpus > /dev/null, or -1 if it fails */
+static double
+run_build (std::string const& build, std::string const& corpus)
+{
+    pid_t pid = fork ();
+    if (pid < 0)
+        return -1;
+    if (0 == pid) {
+        int in = open (corpus.c_str (), O_RDONLY);
+        int out = open ("/dev/null", O_WRONLY);
+        if (in < 0 || out < 0 || dup2 (in, 0) < 0 || dup2 (out, 1) < 0)
+            _exit (127);
+        execl (build.c_str (), build.c_str (), static_cast<char*> (nullptr));
+        _exit (127);
+    }
+    int status;
+    struct rusage ru;
+    if (wait4 (pid, &status, 0, &ru) < 0
+            || ! WIFEXITED (status) || WEXITSTATUS (status) != 0)
+        return -1;
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec
+        + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e-6;
+}
+
+/* {"build": "...", "unit": "s", "corpus": {"name": [seconds, ...], ...}} */
+static void
+save_runs (side_type const& side, std::ostream& output)
+{
+    output << "{\"build\": \"" << side.name << "\", \"unit\": \"s\","
+           << " \"corpus\": {";
+    char const* sep = "\n";
+    for (auto& x : side.runs) {
+        output << sep << "\"" << x.first << "\": [";
+        for (std::size_t i = 0; i < x.second.size (); ++i)
+            output << (i ? ", " : "") << x.second[i];
+        output << "]";
+        sep = ",\n";
+    }
+    output << "\n}}\n";
+}
+
+/* reads the corpus object of save_runs */
+static bool
+load_runs (std::string const& path, side_type& side)
+{
+    std::ifstream file (path);
+    if (! file)
+        return false;
+    std::stringstream buf;
+    buf << file.rdbuf ();
+    std::string json = buf.str ();
+    std::size_t pos = json.find ("\"corpus\"");
+    if (std::string::npos == pos || std::string::npos == (pos = json.find ('{', pos)))
+        return false;
+    for (;;) {
+        std::size_t q1 = json.find_first_of ("\"}", pos + 1);
+        if (std::string::npos == q1 || '}' == json[q1])
+            return true;
+        std::size_t q2 = json.find ('"', q1 + 1);
+        std::size_t b1 = json.find ('[', q2);
+        std::size_t b2 = json.find (']', b1);
+        if (std::string::npos == b2)
+            return false;
+        std::vector<double>& runs = side.runs[json.substr (q1 + 1, q2 - q1 - 1)];
+        std::istringstream values (json.substr (b1 + 1, b2 - b1 - 1));
+        double x;
+        char comma;
+        while (values >> x) {
+            runs.push_back (x);
+            values >> comma;
+        }
+        pos = b2;
+    }
+}
+
+static double
+median (std::vector<double> x)
+{
+    std::sort (x.begin (), x.end ());
+    std::size_t n = x.size ();
+    return n % 2 ? x[n / 2] : (x[n / 2 - 1] + x[n / 2]) / 2;
+}
+
+/* two-sided, by the normal approximation with ties corrected */
+static double
+mann_whitney_p (std::vector<double> const& a, std::vector<double> const& b)
+{
+    std::vector<std::pair<double, int>> all;
+    for (double x : a)
+        all.push_back ({x, 0});
+    for (double x : b)
+        all.push_back ({x, 1});
+    std::sort (all.begin (), all.end ());
+    double n = all.size (), n1 = a.size (), n2 = b.size ();
+    double r1 = 0, ties = 0;
+    for (std::size_t i = 0; i < all.size (); ) {
+        std::size_t j = i;
+        while (j < all.size () && all[j].first == all[i].first)
+            ++j;
+        double t = j - i;
+        double rank = (i + 1 + j) / 2.0;
+        for (std::size_t k = i; k < j; ++k)
+            if (0 == all[k].second)
+                r1 += rank;
+        ties += t * t * t - t;
+        i = j;
+    }
+    double u = r1 - n1 * (n1 + 1) / 2;
+    double mu = n1 * n2 / 2;
+    double sigma = std::sqrt (n1 * n2 / 12 * ((n + 1) - ties / (n * (n - 1))));
+    if (sigma <= 0)
+        return 1;
+    double z = (std::fabs (u - mu) - 0.5) / sigma;
+    return std::min (1.0, std::erfc (std::max (0.0, z) / std::sqrt (2.0)));
+}
+
+/* 95% interval of median b / median a - 1 over resamples of both */
+static void
+bootstrap_delta (std::vector<double> const& a, std::vector<double> const& b,
+    double& lo, double& hi)
+{
+    std::mt19937 rng (20261018);
+    std::vector<double> delta;
+    std::vector<double> ra (a.size ()), rb (b.size ());
+    for (int i = 0; i < 2000; ++i) {
+        for (auto& x : ra)
+            x = a[rng () % a.size ()];
+        for (auto& x : rb)
+            x = b[rng () % b.size ()];
+        delta.push_back (median (rb) / median (ra) - 1);
+    }
+    std::sort (delta.begin (), delta.end ());
+    lo = delta[delta.size () * 25 / 1000];
+    hi = delta[delta.size () * 975 / 1000];
+}
+
+int main (int argc, char* argv[])
+{
+    int runs = 30;
+    double threshold = 0.02;
+    std::string save;
+    std::deque<std::string> arg;
+    bool usage = false;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strncmp (argv[i], "--runs=", 7) == 0)
+            runs = std::max (2, std::atoi (argv[i] + 7));
+        else if (std::strncmp (argv[i], "--threshold=", 12) == 0)
+            threshold = std::atof (argv[i] + 12) / 100;
+        else if (std::strncmp (argv[i], "--save=", 7) == 0)
+            save = argv[i] + 7;
+        else if (std::strncmp (argv[i], "--", 2) != 0)
+            arg.push_back (argv[i]);
+        else
+            usage = true;
+    }
+    if (usage || arg.size () < 3) {
+        std::cerr << "usage: mkdown-compare [--runs=N] [--threshold=PERCENT]"
+            " [--save=FILE] A B CORPUS..." << std::endl;
+        return 2;
+    }
+    side_type side[2];
+    for (int k = 0; k < 2; ++k) {
+        side[k].name = arg[k];
+        side[k].saved = isjson (arg[k]);
+        if (side[k].saved && ! load_runs (arg[k], side[k])) {
+            std::cerr << "mkdown-compare: cannot load " << arg[k] << std::endl;
+            return 2;
+        }
+    }
+    std::deque<std::string> corpus (arg.begin () + 2, arg.end ());
+    for (int i = -1; i < runs; ++i)
+        for (auto& path : corpus)
+            for (int j = 0; j < 2; ++j) {
+                side_type& s = side[(i + j) % 2 == 0 ? 0 : 1];
+                if (s.saved)
+                    continue;
+                double t = run_build (s.name, path);
+                if (t < 0) {
+                    std::cerr << "mkdown-compare: " << s.name << " failed on "
+                        << path << std::endl;
+                    return 2;
+                }
+                if (i >= 0)     // after a warm-up
+                    s.runs[corpus_name (path)].push_back (t);
+            }
+    if (! save.empty ()) {
+        std::ofstream file (save);
+        save_runs (side[1], file);
+    }
+    bool regression = false;
+    std::printf ("%-20s %10s %10s %8s %18s %8s\n",
+        "corpus", "A ms", "B ms", "delta", "95% interval", "p");
+    for (auto& path : corpus) {
+        std::string name = corpus_name (path);
+        std::vector<double> const& a = side[0].runs[name];
+        std::vector<double> const& b = side[1].runs[name];
+        if (a.size () < 2 || b.size () < 2) {
+            std::printf ("%-20s no runs\n", name.c_str ());
+            continue;
+        }
+        double ma = median (a), mb = median (b);
+        double lo, hi;
+        bootstrap_delta (a, b, lo, hi);
+        double p = mann_whitney_p (a, b);
+        double delta = mb / ma - 1;
+        bool slower = p < 0.05 && delta > threshold;
+        regression = regression || slower;
+        std::printf ("%-20s %10.2f %10.2f %+7.1f%% [%+6.1f%%, %+6.1f%%] %8.4f%s\n",
+            name.c_str (), ma * 1e3, mb * 1e3, delta * 100, lo * 100, hi * 100,
+            p, slower ? " regression" : p < 0.05 && delta < 0 ? " faster" : "");
+    }
+    return regression ? 1 : 0;
+}
@@ -0,0 +1,531 @@
+/* fuzzer of markdown () for crashes, hangs and slow inputs.
+ *
+ * with clang and libfuzzer, slow inputs abort as crashes do:
+ *    $ make mkdown-libfuzzer
+ *    $ ./mkdown-libfuzzer -dict=fuzz/markdown.dict CORPUS mdtest/...
+ *    $ ./mkdown-libfuzzer -minimize_crash=1 -runs=10000 crash-...
+ *
+ * standalone, guided by the pcs of markdown.cpp built with
+ * -fsanitize-coverage=trace-pc, and by the token bytes per byte:
+ *    $ make fuzz
+ *    $ ./mkdown-fuzz [--runs=N] [--seed=N] [--max-len=N] [--dict=FILE]
+ *          [--slow=DIR] [--budget-ns=NS] [--budget-tokens=BYTES] CORPUS...
+ *    $ ./mkdown-fuzz --replay FILE|DIR...
+ *
+ * an input is slow when its render takes over budget-ns per byte, or
+ * allocates over budget-tokens bytes of tokens per byte, beyond floors
+ * for the fixed costs. the standalone fuzzer minimizes slow inputs and
+ * saves them in the slow directory, which the bench target replays.
+ * the first byte of an input selects the options.
+ */
+#include "markdown.hpp"
+#include "tools.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static double budget_ns = 2000;
+static double budget_tokens = 4096;
+static const double floor_ns = 1e6;
+static const double floor_tokens = 1 << 20;
+
+enum {
+    FAST,
+    SLOW_TIME,
+    SLOW_TOKENS,
+};
+
+struct cost_type {
+    double ns;
+    double tokens;          // bytes of token containers allocated
+    std::size_t bytes;
+};
+
+/* utf-8 with invalid sequences as U+FFFD */
+static std::wstring
+decode_input (std::string const& input)
+{
+    std::wstring doc;
+    for (std::size_t i = 0; i < input.size (); ) {
+        unsigned char c = input[i++];
+        int n = c < 0x80 ? 0 : c < 0xc2 ? -1 : c < 0xe0 ? 1 : c < 0xf0 ? 2
+            : c < 0xf5 ? 3 : -1;
+        wchar_t x = n > 0 ? c & (0x3f >> n) : c;
+        for (int k = 0; k < n; ++k, ++i)
+            if (i >= input.size () || (input[i] & 0xc0) != 0x80) {
+                n = -1;
+                break;
+            }
+            else
+                x = (x << 6) | (input[i] & 0x3f);
+        doc.push_back (n < 0 || (x >= 0xd800 && x < 0xe000) || x > 0x10ffff
+            ? 0xfffd : x);
+    }
+    return doc;
+}
+
+static bool
+isname (wchar_t c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9');
+}
+
+/* options by the bits of the first byte:
+ *    1 smart, 2 math, 4 emoji, 8 all the sinks, 16 wiki and @names,
+ *    64 !include, 128 chunks of input, or the pull api with 32.
+ */
+static cost_type
+render (std::string const& input)
+{
+    unsigned flags = input.empty () ? 0 : static_cast<unsigned char> (input[0]);
+    std::wstring doc = decode_input (input);
+    markdown_options options;
+    options.smart = flags & 1;
+    options.math = flags & 2;
+    options.emoji = flags & 4;
+    if (flags & 16) {
+        options.wiki.exists = [](std::deque<std::wstring> const& pages) {
+            std::deque<bool> exists;
+            for (auto& page : pages)
+                exists.push_back (page.size () % 2);
+            return exists;
+        };
+        options.inlines.push_back ({'@', isname,
+            [](std::deque<std::wstring> const& names) {
+                std::deque<std::wstring> uris;
+                for (auto& name : names)
+                    uris.push_back (name.size () % 2 ? L"/u/" + name : L"");
+                return uris;
+            }});
+    }
+    if (flags & 64) {
+        options.include.path = "doc.md";
+        options.include.read = [](std::string const& path, std::wstring& content) {
+            content = L"*included* [" + std::wstring (path.begin (), path.end ())
+                + L"]\n\n!include a.md\n";
+            return path.size () < 8;
+        };
+    }
+    nullbuf_type buf;
+    std::wostream html (&buf);
+    std::wostringstream text;
+    std::deque<markdown_heading> outline;
+    std::deque<markdown_link> links;
+    markdown_frontmatter frontmatter {};
+    markdown_stats stats {};
+    markdown_memory memory {};
+    markdown_sink sink {&html};
+    sink.memory = &memory;
+    if (flags & 8) {
+        sink.text = &text;
+        sink.outline = &outline;
+        sink.links = &links;
+        sink.frontmatter = &frontmatter;
+        sink.stats = &stats;
+    }
+    auto t0 = std::chrono::steady_clock::now ();
+    if ((flags & 128) && (flags & 32)) {
+        markdown_reader reader (doc, options, &memory);
+        wchar_t chunk[256];
+        while (reader.read (chunk, 256) > 0)
+            ;
+    }
+    else if (flags & 128) {
+        std::deque<std::wstring> chunks;
+        for (std::size_t i = 0; i < doc.size (); i += 7)
+            chunks.push_back (doc.substr (i, 7));
+        markdown (chunks, sink, options);
+    }
+    else
+        markdown (doc, sink, options);
+    auto t1 = std::chrono::steady_clock::now ();
+    cost_type cost;
+    cost.ns = std::chrono::duration<double, std::nano> (t1 - t0).count ();
+    cost.tokens = memory.kind[MDALLOC_LINES].bytes
+        + memory.kind[MDALLOC_BLOCKS].bytes + memory.kind[MDALLOC_INLINES].bytes;
+    cost.bytes = input.size ();
+    return cost;
+}
+
+static int
+slowness (cost_type const& cost)
+{
+    double bytes = std::max<std::size_t> (cost.bytes, 1);
+    if (cost.tokens > floor_tokens && cost.tokens / bytes > budget_tokens)
+        return SLOW_TOKENS;
+    if (cost.ns > floor_ns && cost.ns / bytes > budget_ns)
+        return SLOW_TIME;
+    return FAST;
+}
+
+/* the fastest of reps renders, but only one of a fast input */
+static cost_type
+measure (std::string const& input, int reps = 3)
+{
+    cost_type cost = render (input);
+    if (SLOW_TIME == slowness (cost) || reps > 3)
+        for (int i = 1; i < reps; ++i)
+            cost.ns = std::min (cost.ns, render (input).ns);
+    return cost;
+}
+
+#ifdef MARKDOWN_LIBFUZZER
+
+static double
+env_budget (char const* name, double value)
+{
+    char const* s = std::getenv (name);
+    return s ? std::atof (s) : value;
+}
+
+extern "C" int
+LLVMFuzzerTestOneInput (std::uint8_t const* data, std::size_t size)
+{
+    static bool init = false;
+    if (! init) {
+        budget_ns = env_budget ("MKDOWN_BUDGET_NS", budget_ns);
+        budget_tokens = env_budget ("MKDOWN_BUDGET_TOKENS", budget_tokens);
+        init = true;
+    }
+    std::string input (reinterpret_cast<char const*> (data), size);
+    cost_type cost = measure (input);
+    if (FAST != slowness (cost)) {
+        std::fprintf (stderr, "slow input: %zu bytes, %.0f ns/byte,"
+            " %.0f token bytes/byte\n", size, cost.ns / std::max<std::size_t> (size, 1),
+            cost.tokens / std::max<std::size_t> (size, 1));
+        std::abort ();
+    }
+    return 0;
+}
+
+#else
+
+/* pcs of the instrumented code reached by the current input */
+static unsigned char coverage[1 << 16];
+
+extern "C" void
+__sanitizer_cov_trace_pc ()
+{
+    std::uintptr_t pc = reinterpret_cast<std::uintptr_t> (__builtin_return_address (0));
+    coverage[(pc ^ (pc >> 16)) & 0xffff] = 1;
+}
+
+/* the input to save when it crashes or hangs */
+static std::string const* current;
+
+static void
+save_current (int sig)
+{
+    char const* path = SIGALRM == sig ? "hang-input.md" : "crash-input.md";
+    int fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0 && current) {
+        ssize_t n = write (fd, current->data (), current->size ());
+        close (fd);
+        (void) n;
+    }
+    char const* msg = SIGALRM == sig ? "mkdown-fuzz: hang, saved in hang-input.md\n"
+        : "mkdown-fuzz: crash, saved in crash-input.md\n";
+    ssize_t n = write (2, msg, std::strlen (msg));
+    (void) n;
+    _exit (1);
+}
+
+static bool
+read_input (std::string const& path, std::string& input)
+{
+    std::ifstream file (path, std::ios::binary);
+    if (! file)
+        return false;
+    std::stringstream buf;
+    buf << file.rdbuf ();
+    input = buf.str ();
+    return true;
+}
+
+/* the files of a directory, or the file itself */
+static void
+list_files (std::string const& path, std::deque<std::string>& files)
+{
+    DIR* dir = opendir (path.c_str ());
+    if (! dir) {
+        files.push_back (path);
+        return;
+    }
+    std::deque<std::string> names;
+    while (struct dirent* e = readdir (dir)) {
+        std::string name = path + "/" + e->d_name;
+        struct stat st;
+        if (stat (name.c_str (), &st) == 0 && S_ISREG (st.st_mode))
+            names.push_back (name);
+    }
+    closedir (dir);
+    std::sort (names.begin (), names.end ());
+    files.insert (files.end (), names.begin (), names.end ());
+}
+
+static int
+hexdigit (char c)
+{
+    return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10
+        : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+}
+
+/* name="token" or "token" lines of the libfuzzer format, with \\, \"
+ * and \xNN escapes, and # comments.
+ */
+static bool
+read_dict (std::string const& path, std::deque<std::string>& dict)
+{
+    std::ifstream file (path);
+    if (! file)
+        return false;
+    std::string line;
+    while (std::getline (file, line)) {
+        std::size_t q1 = line.find ('"');
+        std::size_t q2 = line.rfind ('"');
+        if (line.empty () || '#' == line[0] || std::string::npos == q1 || q1 == q2)
+            continue;
+        std::string token;
+        for (std::size_t i = q1 + 1; i < q2; ++i)
+            if ('\\' != line[i] || i + 1 == q2)
+                token.push_back (line[i]);
+            else if ('x' == line[++i] && i + 2 < q2
+                    && hexdigit (line[i + 1]) >= 0 && hexdigit (line[i + 2]) >= 0) {
+                token.push_back (hexdigit (line[i + 1]) * 16 + hexdigit (line[i + 2]));
+                i += 2;
+            }
+            else
+                token.push_back (line[i]);
+        dict.push_back (token);
+    }
+    return true;
+}
+
+static const char markup[] = "*_`[]()<>!#&\\:$-=|~^+.\"' \n\t";
+
+/* a few edits of input, of which repeats of a slice find superlinear
+ * scans.
+ */
+static void
+mutate (std::string& input, std::deque<std::string> const& dict,
+    std::deque<std::string> const& corpus, std::mt19937& rng)
+{
+    for (int n = 1 + rng () % 4; n > 0; --n) {
+        std::size_t pos = input.empty () ? 0 : rng () % (input.size () + 1);
+        std::size_t len = std::min<std::size_t> (1 + rng () % 16, input.size () - std::min (pos, input.size ()));
+        switch (rng () % 6) {
+        case 0:
+            if (! dict.empty ())
+                input.insert (pos, dict[rng () % dict.size ()]);
+            break;
+        case 1:
+            input.erase (pos, len);
+            break;
+        case 2:
+            if (pos < input.size ())
+                input[pos] = markup[rng () % (sizeof markup - 1)];
+            break;
+        case 3: {
+            std::string slice = input.substr (pos, len);
+            for (int k = 1 + rng () % 64; k > 0; --k)
+                input.insert (pos, slice);
+            break;
+        }
+        case 4: {
+            std::string const& other = corpus[rng () % corpus.size ()];
+            std::size_t from = other.empty () ? 0 : rng () % other.size ();
+            input.insert (pos, other.substr (from, 1 + rng () % 64));
+            break;
+        }
+        default:
+            input.insert (pos, 1, static_cast<char> (rng () % 256));
+        }
+    }
+}
+
+/* measure under an alarm that saves a hanging input */
+static cost_type
+measure_current (std::string const& input, int reps = 3)
+{
+    current = &input;
+    alarm (10);
+    cost_type cost = measure (input, reps);
+    alarm (0);
+    return cost;
+}
+
+/* removes halves, quarters, ... of input while it stays slow the same way */
+static std::string
+minimize (std::string input, int slow)
+{
+    int tries = 4096;
+    for (std::size_t chunk = input.size () / 2; chunk > 0 && tries > 0; chunk /= 2)
+        for (std::size_t i = 0; i + chunk <= input.size () && tries > 0; --tries) {
+            std::string shorter (input);
+            shorter.erase (i, chunk);
+            if (slowness (measure_current (shorter)) == slow)
+                input.swap (shorter);
+            else
+                i += chunk;
+        }
+    return input;
+}
+
+/* slow-HASH.md in dir */
+static std::string
+save_slow (std::string const& input, std::string const& dir)
+{
+    std::uint64_t h = 14695981039346656037ull;
+    for (char c : input)
+        h = (h ^ static_cast<unsigned char> (c)) * 1099511628211ull;
+    char name[32];
+    std::snprintf (name, sizeof name, "slow-%016llx.md",
+        static_cast<unsigned long long> (h));
+    std::string path = dir + "/" + name;
+    std::ofstream file (path, std::ios::binary);
+    file << input;
+    return file ? path : "";
+}
+
+static void
+print_cost (char const* name, cost_type const& cost)
+{
+    double bytes = std::max<std::size_t> (cost.bytes, 1);
+    std::printf ("%-40s %8zu %12.1f %12.1f%s\n", name, cost.bytes,
+        cost.ns / bytes, cost.tokens / bytes,
+        SLOW_TIME == slowness (cost) ? " slow"
+        : SLOW_TOKENS == slowness (cost) ? " tokens" : "");
+}
+
+/* the fastest of 5 renders of each file */
+static int
+replay (std::deque<std::string> const& files)
+{
+    std::printf ("%-40s %8s %12s %12s\n", "input", "bytes", "ns/byte",
+        "tokens/byte");
+    for (auto& path : files) {
+        std::string input;
+        if (! read_input (path, input)) {
+            std::fprintf (stderr, "mkdown-fuzz: cannot read %s\n", path.c_str ());
+            return EXIT_FAILURE;
+        }
+        print_cost (path.c_str (), measure_current (input, 5));
+    }
+    return EXIT_SUCCESS;
+}
+
+static int
+fuzz (std::deque<std::string> const& files, std::deque<std::string> const& dict,
+    std::string const& slowdir, long runs, unsigned seed, std::size_t maxlen)
+{
+    std::deque<std::string> corpus;
+    for (auto& path : files) {
+        std::string input;
+        if (read_input (path, input))
+            corpus.push_back (input.substr (0, maxlen));
+    }
+    if (corpus.empty ())
+        corpus.push_back ("");
+    static unsigned char covered[sizeof coverage];
+    std::size_t edges = 0, nslow = 0;
+    double maxtokens = 0;
+    std::mt19937 rng (seed);
+    for (long run = 0; runs < 0 || run < runs; ++run) {
+        bool seeding = run < static_cast<long> (corpus.size ());
+        std::string input = corpus[seeding ? run : rng () % corpus.size ()];
+        if (! seeding) {
+            mutate (input, dict, corpus, rng);
+            input.resize (std::min (input.size (), maxlen));
+        }
+        std::memset (coverage, 0, sizeof coverage);
+        cost_type cost = measure_current (input);
+        bool grown = false;
+        for (std::size_t i = 0; i < sizeof coverage; ++i)
+            if (coverage[i] && ! covered[i]) {
+                covered[i] = 1;
+                ++edges;
+                grown = true;
+            }
+        double tokens = cost.tokens / std::max<std::size_t> (cost.bytes, 1);
+        int slow = slowness (cost);
+        if (FAST != slow) {
+            std::string small = minimize (input, slow);
+            std::string path = save_slow (small, slowdir);
+            ++nslow;
+            std::printf ("#%ld slow: %zu bytes, minimized to %zu, %s\n", run,
+                input.size (), small.size (),
+                path.empty () ? "not saved" : path.c_str ());
+        }
+        else if (! seeding && (grown || tokens > maxtokens * 1.1)) {
+            corpus.push_back (input);
+            maxtokens = std::max (maxtokens, tokens);
+        }
+        else if (seeding)
+            maxtokens = std::max (maxtokens, tokens);
+        if ((run & (run - 1)) == 0 && run >= 1024)
+            std::printf ("#%ld corpus %zu pcs %zu slow %zu max %.0f tokens/byte\n",
+                run, corpus.size (), edges, nslow, maxtokens);
+        std::fflush (stdout);
+    }
+    std::printf ("done: corpus %zu pcs %zu slow %zu\n", corpus.size (), edges, nslow);
+    return EXIT_SUCCESS;
+}
+
+int main (int argc, char* argv[])
+{
+    long runs = -1;
+    unsigned seed = 20261018;
+    std::size_t maxlen = 4096;
+    std::string slowdir (".");
+    std::deque<std::string> dict, files;
+    bool replaying = false;
+    bool usage = false;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strncmp (argv[i], "--runs=", 7) == 0)
+            runs = std::atol (argv[i] + 7);
+        else if (std::strncmp (argv[i], "--seed=", 7) == 0)
+            seed = std::strtoul (argv[i] + 7, nullptr, 10);
+        else if (std::strncmp (argv[i], "--max-len=", 10) == 0)
+            maxlen = std::strtoul (argv[i] + 10, nullptr, 10);
+        else if (std::strncmp (argv[i], "--dict=", 7) == 0)
+            usage = usage || ! read_dict (argv[i] + 7, dict);
+        else if (std::strncmp (argv[i], "--slow=", 7) == 0)
+            slowdir = argv[i] + 7;
+        else if (std::strncmp (argv[i], "--budget-ns=", 12) == 0)
+            budget_ns = std::atof (argv[i] + 12);
+        else if (std::strncmp (argv[i], "--budget-tokens=", 16) == 0)
+            budget_tokens = std::atof (argv[i] + 16);
+        else if (std::strcmp (argv[i], "--replay") == 0)
+            replaying = true;
+        else if (std::strncmp (argv[i], "--", 2) != 0)
+            list_files (argv[i], files);
+        else
+            usage = true;
+    }
+    if (usage) {
+        std::fprintf (stderr, "usage: mkdown-fuzz [--runs=N] [--seed=N]"
+            " [--max-len=N] [--dict=FILE] [--slow=DIR] [--budget-ns=NS]"
+            " [--budget-tokens=BYTES] CORPUS...\n"
+            "       mkdown-fuzz --replay FILE|DIR...\n");
+        return EXIT_FAILURE;
+    }
+    for (int sig : {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT, SIGALRM})
+        signal (sig, save_current);
+    if (replaying)
+        return replay (files);
+    return fuzz (files, dict, slowdir, runs, seed, maxlen);
+}
+
+#endif
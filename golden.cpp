@@ -0,0 +1,667 @@
+/* golden outputs of a large generated corpus of markdown documents.
+ *
+ *    $ make golden
+ *    $ ./mkdown-golden [--docs=N] [--size=BYTES] --record BUILD > SUMS
+ *    $ ./mkdown-golden --check=SUMS BUILD
+ *    $ ./mkdown-golden --reduce=DOC BASE BUILD
+ *    $ ./mkdown-golden [--docs=N] [--size=BYTES] --print=DOC
+ *
+ * the documents mix every construct of the parser, lazy lines, nested
+ * lists and quotes, code blocks and fences, block html, reference
+ * links, rubies, inline html and the markup of the options, from a
+ * fixed seed for each. builds filter stdin to stdout with the options
+ * of each document, and SUMS records the fnv-1a hashes of the inputs
+ * and of the outputs. --check fails on any byte of difference.
+ *
+ * --reduce renders a document with BASE, a build of the recorded
+ * outputs, and with BUILD, finds the first block where their outputs
+ * differ, and removes the blocks and lines it does not need. the
+ * reduced input is saved in golden-reduced.md.
+ */
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+typedef std::vector<std::string> lines_type;
+
+/* options of the documents, by index */
+static char const* const document_options[]{
+    "", "--smart", "--math", "--emoji", "--admonition", "--chunk=7",
+    "--smart --math --emoji", "--pull=3",
+};
+
+static const int noptions = sizeof document_options / sizeof *document_options;
+
+static char const* const word[]{
+    "lorem", "ipsum", "dolor", "sit", "amet", "markdown", "parser", "block",
+    "inline", "token", "lazy", "ruby", "fence", "list", "quote", "link",
+    "x", "y2", "a_b", "snake_case_word", "2*3", "C++", "AT&T", "a<b", "x>y",
+    "e.g.", "100%", "#hash", "don't", "end.", "1986.", "(paren)", "tab\there",
+};
+
+static const int nwords = sizeof word / sizeof *word;
+
+static const int nids = 24;
+
+struct generator_type {
+    std::mt19937 rng;
+
+    unsigned pick (unsigned n) { return rng () % n; }
+    bool chance (unsigned percent) { return pick (100) < percent; }
+};
+
+static std::string phrase (generator_type& g, int depth, int n);
+
+/* the strings in order, as the operands of + are not sequenced and
+ * the generator must draw the same numbers with any compiler
+ */
+static std::string
+cat (std::initializer_list<std::string> parts)
+{
+    std::string s;
+    for (auto& x : parts)
+        s += x;
+    return s;
+}
+
+static std::string
+refid (generator_type& g)
+{
+    return "id" + std::to_string (g.pick (nids));
+}
+
+static std::string
+url (generator_type& g)
+{
+    static char const* const path[]{
+        "http://example.com/", "https://example.org/a/b?c=1&d=2",
+        "/relative/path.html", "#anchor", "mailto:user@example.com",
+        "http://example.com/a_(b)_c", "http://example.com/%20space",
+        "ftp://example.net/file.txt",
+    };
+    std::string s = path[g.pick (8)];
+    return g.chance (50) ? s + std::to_string (g.pick (1000)) : s;
+}
+
+static std::string
+title (generator_type& g)
+{
+    switch (g.pick (4)) {
+    case 0: return " \"a \\\"title\\\" & more\"";
+    case 1: return cat ({" 'single ", word[g.pick (nwords)], "'"});
+    case 2: return " (paren title)";
+    default: return "";
+    }
+}
+
+/* an inline construct, nested below depth */
+static std::string
+span (generator_type& g, int depth)
+{
+    if (depth > 2)
+        return word[g.pick (nwords)];
+    int d = depth + 1;
+    switch (g.pick (64)) {
+    case 0: return cat ({"*", phrase (g, d, 2), "*"});
+    case 1: return cat ({"**", phrase (g, d, 2), "**"});
+    case 2: return cat ({"_", phrase (g, d, 2), "_"});
+    case 3: return cat ({"__", phrase (g, d, 2), "__"});
+    case 4: return cat ({"***", phrase (g, d, 2), "***"});
+    case 5: return "in*tra*word";
+    case 6: return cat ({"`", word[g.pick (nwords)], " <b>*x*</b>`"});
+    case 7: return "`` a ` b ``";
+    case 8: return cat ({"[", phrase (g, d, 2), "](", url (g), title (g), ")"});
+    case 9: return cat ({"[", phrase (g, d, 1), "](<", url (g), ">)"});
+    case 10: return cat ({"![", phrase (g, 3, 2), "](", url (g), title (g), ")"});
+    case 11: return cat ({"[", phrase (g, d, 2), "][", refid (g), "]"});
+    case 12: return cat ({"[", refid (g), "][]"});
+    case 13: return cat ({"[", refid (g), "]"});
+    case 14: return cat ({"![", phrase (g, 3, 1), "][", refid (g), "]"});
+    case 15: return cat ({"<http://example.com/auto?q=",
+        std::to_string (g.pick (99)), ">"});
+    case 16: return cat ({"<user", std::to_string (g.pick (99)), "@example.com>"});
+    case 17: return cat ({"<span class=\"c\">", phrase (g, d, 2), "</span>"});
+    case 18: return "<b>bold</b> <br/> <img src=\"a.png\" alt=\"a\">";
+    case 19: return "<!-- inline comment -->";
+    case 20: return "&amp; &copy; &#169; &#xA9; & &nbsp;";
+    case 21: return "\\* \\_ \\` \\\\ \\[ \\] \\# \\. \\!";
+    case 22: return cat ({"[", word[g.pick (5)], "]^(", word[g.pick (5)], ")"});
+    case 23: return cat ({"[", phrase (g, d, 2), "]^(ru by)"});
+    case 24: return cat ({"$x^", std::to_string (g.pick (9)), " + \\alpha$"});
+    case 25: return ":smile: :+1: :no_such_emoji:";
+    case 26: return "\"double quotes\" and 'single' ones";
+    case 27: return "a -- b --- c... d";
+    case 28: return "[unclosed bracket";
+    case 29: return "lone * and _ and ` marks";
+    case 30: return "a < b > c & d";
+    case 31: return cat ({"(", phrase (g, d, 2), ")"});
+    default: return word[g.pick (nwords)];
+    }
+}
+
+static std::string
+phrase (generator_type& g, int depth, int n)
+{
+    std::string s = span (g, depth);
+    for (int i = 1 + g.pick (n); i > 0; --i)
+        s += " " + span (g, depth);
+    return s;
+}
+
+/* text lines, some with hard breaks */
+static lines_type
+paragraph (generator_type& g)
+{
+    lines_type lines;
+    for (int i = 1 + g.pick (4); i > 0; --i) {
+        lines.push_back (phrase (g, 0, 8));
+        if (g.chance (10))
+            lines.back () += "  ";
+    }
+    return lines;
+}
+
+static void
+append (lines_type& lines, lines_type const& more)
+{
+    lines.insert (lines.end (), more.begin (), more.end ());
+}
+
+/* prefix on the first line, indent on the rest, lazy paragraph lines
+ * without it
+ */
+static void
+nest (generator_type& g, lines_type& lines, lines_type const& inner,
+    std::string const& first, std::string const& rest, bool lazy)
+{
+    for (std::size_t i = 0; i < inner.size (); ++i) {
+        if (0 == i)
+            lines.push_back (first + inner[i]);
+        else if (inner[i].empty ())
+            lines.push_back (rest.substr (0, rest.find_last_not_of (' ') + 1));
+        else if (lazy && g.chance (30))
+            lines.push_back (inner[i]);
+        else
+            lines.push_back (rest + inner[i]);
+    }
+}
+
+static lines_type block (generator_type& g, int depth);
+
+static lines_type
+codeblock (generator_type& g)
+{
+    lines_type lines;
+    for (int i = 1 + g.pick (5); i > 0; --i) {
+        std::string indent = g.chance (20) ? "\t" : "    ";
+        lines.push_back (cat ({indent, std::string (g.pick (3), ' '),
+            "if (a < b && *p) { return \"[x](y)\"; }"}));
+    }
+    return lines;
+}
+
+static lines_type
+fence (generator_type& g)
+{
+    static char const* const info[]{"", "cpp", " ruby", "{.class}", "math"};
+    std::size_t n = 3 + g.pick (2);
+    std::string mark (n, g.chance (50) ? '`' : '~');
+    lines_type lines {mark + info[g.pick (5)]};
+    for (int i = g.pick (6); i > 0; --i) {
+        std::string indent (g.pick (4), ' ');
+        lines.push_back (cat ({indent, "*not* [a](link) <b>",
+            g.chance (20) ? mark.substr (1) : "", " &amp;"}));
+    }
+    if (g.chance (20))
+        lines.push_back ("");
+    lines.push_back (mark);
+    return lines;
+}
+
+static lines_type
+list (generator_type& g, int depth)
+{
+    static char const* const bullet[]{"* ", "- ", "+ "};
+    bool ordered = g.chance (40);
+    bool loose = g.chance (30);
+    std::string marker = bullet[g.pick (3)];
+    unsigned start = g.chance (20) ? g.pick (100) : 1;
+    lines_type lines;
+    for (int i = 1 + g.pick (4); i > 0; --i) {
+        std::string m = ordered ? std::to_string (start++) + ". " : marker;
+        m.resize (std::max<std::size_t> (m.size (), 4), ' ');
+        lines_type inner = paragraph (g);
+        if (depth < 3 && g.chance (40)) {
+            if (g.chance (30))
+                inner.push_back ("");
+            append (inner, block (g, depth + 1));
+        }
+        nest (g, lines, inner, m, "    ", true);
+        if (loose && i > 1)
+            lines.push_back ("");
+    }
+    return lines;
+}
+
+static lines_type
+blockquote (generator_type& g, int depth)
+{
+    lines_type inner = paragraph (g);
+    for (int i = g.pick (3); i > 0 && depth < 3; --i) {
+        inner.push_back ("");
+        append (inner, block (g, depth + 1));
+    }
+    lines_type lines;
+    nest (g, lines, inner, "> ", "> ", g.chance (50));
+    return lines;
+}
+
+static lines_type
+heading (generator_type& g)
+{
+    std::string text = phrase (g, 1, 3);
+    switch (g.pick (3)) {
+    case 0: return {text, std::string (3 + g.pick (5), '=')};
+    case 1: return {text, std::string (3 + g.pick (5), '-')};
+    default:
+        std::string level (1 + g.pick (6), '#');
+        return {level + " " + text + (g.chance (30) ? " " + level : "")};
+    }
+}
+
+static lines_type
+blockhtml (generator_type& g)
+{
+    switch (g.pick (4)) {
+    case 0: return {"<div class=\"note\">", "<div>", "*not emphasis*", "</div>",
+        "</div>"};
+    case 1: return {"<table>", "  <tr><td>[a](b) &amp; c</td></tr>", "</table>"};
+    case 2: return {"<!-- a comment", "over *lines* -->"};
+    default: return {"<pre>", "    indented <b>tag</b>", "</pre>"};
+    }
+}
+
+static lines_type
+refdef (generator_type& g)
+{
+    lines_type lines;
+    for (int i = 1 + g.pick (3); i > 0; --i) {
+        std::string indent (g.pick (4), ' ');
+        std::string id = refid (g);
+        bool angle = g.chance (20);
+        lines.push_back (cat ({indent, "[", id, "]: ", angle ? "<" : "", url (g),
+            angle ? ">" : "", title (g)}));
+    }
+    return lines;
+}
+
+static lines_type
+hrule (generator_type& g)
+{
+    static char const* const rule[]{"***", "* * *", "---", "- - - -", "___",
+        "_____"};
+    return {rule[g.pick (6)]};
+}
+
+/* a block, with containers below depth */
+static lines_type
+block (generator_type& g, int depth)
+{
+    switch (g.pick (depth > 0 ? 6 : 14)) {
+    case 0: return list (g, depth);
+    case 1: return blockquote (g, depth);
+    case 2: return codeblock (g);
+    case 3: return fence (g);
+    case 4: return heading (g);
+    case 5: return hrule (g);
+    case 6: return blockhtml (g);
+    case 7: return refdef (g);
+    case 8: return {"$$", "\\sum_{i=0}^n x_i < y", "$$"};
+    case 9: {
+        lines_type lines {":::note"};
+        append (lines, paragraph (g));
+        lines.push_back (":::");
+        return lines;
+    }
+    default: return paragraph (g);
+    }
+}
+
+/* blocks up to size bytes from the seed of the document */
+static std::string
+generate (int doc, std::size_t size)
+{
+    generator_type g {std::mt19937 (20261018 + doc)};
+    std::string out;
+    while (out.size () < size) {
+        for (auto& line : block (g, 0))
+            out += line + "\n";
+        out += g.chance (10) ? "" : "\n";
+    }
+    return out;
+}
+
+static std::uint64_t
+fnv1a (std::string const& s)
+{
+    std::uint64_t h = 14695981039346656037ull;
+    for (char c : s)
+        h = (h ^ static_cast<unsigned char> (c)) * 1099511628211ull;
+    return h;
+}
+
+static std::string tmpinput, tmpoutput;
+
+/* build with options < input > output, or false if it fails */
+static bool
+render (std::string const& build, std::string const& options,
+    std::string const& input, std::string& output)
+{
+    {
+        std::ofstream file (tmpinput, std::ios::binary);
+        file << input;
+        if (! file)
+            return false;
+    }
+    std::vector<std::string> arg {build};
+    std::istringstream words (options);
+    for (std::string s; words >> s; )
+        arg.push_back (s);
+    pid_t pid = fork ();
+    if (pid < 0)
+        return false;
+    if (0 == pid) {
+        std::vector<char*> argv;
+        for (auto& s : arg)
+            argv.push_back (&s[0]);
+        argv.push_back (nullptr);
+        int in = open (tmpinput.c_str (), O_RDONLY);
+        int out = open (tmpoutput.c_str (), O_WRONLY | O_TRUNC);
+        if (in < 0 || out < 0 || dup2 (in, 0) < 0 || dup2 (out, 1) < 0)
+            _exit (127);
+        execv (build.c_str (), argv.data ());
+        _exit (127);
+    }
+    int status;
+    if (waitpid (pid, &status, 0) < 0
+            || ! WIFEXITED (status) || WEXITSTATUS (status) != 0)
+        return false;
+    std::ifstream file (tmpoutput, std::ios::binary);
+    std::stringstream buf;
+    buf << file.rdbuf ();
+    output = buf.str ();
+    return true;
+}
+
+/* # docs=N size=BYTES
+ * DOC INPUT-HASH OUTPUT-HASH OPTIONS...
+ */
+static int
+record (std::string const& build, int docs, std::size_t size)
+{
+    std::printf ("# docs=%d size=%zu\n", docs, size);
+    for (int i = 0; i < docs; ++i) {
+        std::string input = generate (i, size), output;
+        char const* options = document_options[i % noptions];
+        if (! render (build, options, input, output)) {
+            std::fprintf (stderr, "mkdown-golden: %s failed on %d\n",
+                build.c_str (), i);
+            return EXIT_FAILURE;
+        }
+        std::printf ("%d %016llx %016llx%s%s\n", i,
+            static_cast<unsigned long long> (fnv1a (input)),
+            static_cast<unsigned long long> (fnv1a (output)),
+            *options ? " " : "", options);
+    }
+    return EXIT_SUCCESS;
+}
+
+static int
+check (std::string const& sums, std::string const& build)
+{
+    std::ifstream file (sums);
+    std::string line;
+    int docs = 0;
+    std::size_t size = 0;
+    if (! std::getline (file, line)
+            || std::sscanf (line.c_str (), "# docs=%d size=%zu", &docs, &size) != 2) {
+        std::fprintf (stderr, "mkdown-golden: cannot read %s\n", sums.c_str ());
+        return EXIT_FAILURE;
+    }
+    int failed = 0;
+    std::size_t bytes = 0;
+    while (std::getline (file, line)) {
+        int i;
+        unsigned long long inhash, outhash;
+        if (std::sscanf (line.c_str (), "%d %llx %llx", &i, &inhash, &outhash) != 3)
+            continue;
+        std::string input = generate (i, size), output;
+        bytes += input.size ();
+        char const* options = document_options[i % noptions];
+        if (fnv1a (input) != inhash) {
+            std::printf ("document %d: generated input differs, record again\n", i);
+            ++failed;
+        }
+        else if (! render (build, options, input, output)) {
+            std::printf ("document %d: %s failed\n", i, build.c_str ());
+            ++failed;
+        }
+        else if (fnv1a (output) != outhash) {
+            std::printf ("document %d: output differs, make golden-reduce DOC=%d"
+                " BASE=...\n", i, i);
+            ++failed;
+        }
+    }
+    std::printf ("%d documents of %zu bytes, %d failed\n", docs, bytes, failed);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* blank line separated blocks, with their blank lines */
+static lines_type
+split_blocks (std::string const& input)
+{
+    lines_type blocks;
+    std::string cur;
+    std::istringstream lines (input);
+    for (std::string line; std::getline (lines, line); ) {
+        cur += line + "\n";
+        if (line.empty ()) {
+            blocks.push_back (cur);
+            cur.clear ();
+        }
+    }
+    if (! cur.empty ())
+        blocks.push_back (cur);
+    return blocks;
+}
+
+static std::string
+join (lines_type const& parts)
+{
+    std::string s;
+    for (auto& x : parts)
+        s += x;
+    return s;
+}
+
+struct reducer_type {
+    std::string base, build, options;
+    int renders;
+
+    /* true if base and build render input differently */
+    bool differ (std::string const& input)
+    {
+        std::string a, b;
+        ++renders;
+        bool oka = render (base, options, input, a);
+        bool okb = render (build, options, input, b);
+        return oka != okb || a != b;
+    }
+};
+
+/* removes chunks of parts before the last while they differ, halving
+ * the chunks down to single parts
+ */
+static lines_type
+remove_parts (reducer_type& r, lines_type parts)
+{
+    for (std::size_t chunk = std::max<std::size_t> (parts.size () / 2, 1); ;
+            chunk /= 2) {
+        for (std::size_t i = 0; i + 1 < parts.size (); ) {
+            std::size_t n = std::min (chunk, parts.size () - 1 - i);
+            lines_type less (parts.begin (), parts.begin () + i);
+            less.insert (less.end (), parts.begin () + i + n, parts.end ());
+            if (r.differ (join (less)))
+                parts = less;
+            else
+                i += n;
+        }
+        if (chunk <= 1)
+            return parts;
+    }
+}
+
+static lines_type
+split_lines (std::string const& input)
+{
+    lines_type lines;
+    std::istringstream in (input);
+    for (std::string line; std::getline (in, line); )
+        lines.push_back (line + "\n");
+    return lines;
+}
+
+/* words with their spaces, and lines ends */
+static lines_type
+split_words (std::string const& input)
+{
+    lines_type words;
+    std::string cur;
+    for (char c : input) {
+        if (! cur.empty () && ' ' != c && ' ' == cur.back ()) {
+            words.push_back (cur);
+            cur.clear ();
+        }
+        cur.push_back (c);
+        if ('\n' == c) {
+            words.push_back (cur);
+            cur.clear ();
+        }
+    }
+    if (! cur.empty ())
+        words.push_back (cur);
+    return words;
+}
+
+static int
+reduce (int doc, std::size_t size, std::string const& base,
+    std::string const& build)
+{
+    reducer_type r {base, build, document_options[doc % noptions], 0};
+    std::string input = generate (doc, size);
+    if (! r.differ (input)) {
+        std::printf ("document %d: %s and %s render the same\n", doc,
+            base.c_str (), build.c_str ());
+        return EXIT_SUCCESS;
+    }
+    /* the shortest prefix of blocks that differs */
+    lines_type blocks = split_blocks (input);
+    std::size_t lo = 1, hi = blocks.size ();
+    while (lo < hi) {
+        std::size_t mid = lo + (hi - lo) / 2;
+        if (r.differ (join (lines_type (blocks.begin (), blocks.begin () + mid))))
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    blocks.resize (lo);
+    std::string first = blocks.back ();
+    std::printf ("document %d, options \"%s\": first differing block %zu:\n%s\n",
+        doc, r.options.c_str (), lo, first.c_str ());
+    std::string reduced = join (remove_parts (r, blocks));
+    reduced = join (remove_parts (r, split_lines (reduced)));
+    reduced = join (remove_parts (r, split_words (reduced)));
+    std::ofstream ("golden-reduced.md", std::ios::binary) << reduced;
+    std::string a, b;
+    render (base, r.options, reduced, a);
+    render (build, r.options, reduced, b);
+    std::printf ("reduced to %zu bytes in %d renders, golden-reduced.md:\n%s\n"
+        "%s:\n%s\n%s:\n%s", reduced.size (), r.renders, reduced.c_str (),
+        base.c_str (), a.c_str (), build.c_str (), b.c_str ());
+    return EXIT_FAILURE;
+}
+
+static bool
+make_tmp (std::string& path)
+{
+    char name[] = "/tmp/mkdown-golden-XXXXXX";
+    int fd = mkstemp (name);
+    if (fd < 0)
+        return false;
+    close (fd);
+    path = name;
+    return true;
+}
+
+int main (int argc, char* argv[])
+{
+    int docs = 16;
+    std::size_t size = 1 << 18;
+    std::string sums;
+    int doc = -1;
+    bool recording = false, reducing = false, printing = false;
+    std::deque<std::string> arg;
+    bool usage = false;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strncmp (argv[i], "--docs=", 7) == 0)
+            docs = std::max (1, std::atoi (argv[i] + 7));
+        else if (std::strncmp (argv[i], "--size=", 7) == 0)
+            size = std::strtoul (argv[i] + 7, nullptr, 10);
+        else if (std::strcmp (argv[i], "--record") == 0)
+            recording = true;
+        else if (std::strncmp (argv[i], "--check=", 8) == 0)
+            sums = argv[i] + 8;
+        else if (std::strncmp (argv[i], "--reduce=", 9) == 0)
+            reducing = true, doc = std::atoi (argv[i] + 9);
+        else if (std::strncmp (argv[i], "--print=", 8) == 0)
+            printing = true, doc = std::atoi (argv[i] + 8);
+        else if (std::strncmp (argv[i], "--", 2) != 0)
+            arg.push_back (argv[i]);
+        else
+            usage = true;
+    }
+    std::size_t nargs = reducing ? 2 : printing ? 0 : 1;
+    if (usage || arg.size () != nargs
+            || recording + reducing + printing + ! sums.empty () != 1) {
+        std::cerr << "usage: mkdown-golden [--docs=N] [--size=BYTES]"
+            " --record BUILD | --check=SUMS BUILD | --reduce=DOC BASE BUILD"
+            " | --print=DOC" << std::endl;
+        return 2;
+    }
+    if (printing) {
+        std::cout << generate (doc, size);
+        return EXIT_SUCCESS;
+    }
+    if (! make_tmp (tmpinput) || ! make_tmp (tmpoutput)) {
+        std::cerr << "mkdown-golden: cannot make temporary files" << std::endl;
+        return 2;
+    }
+    int status = recording ? record (arg[0], docs, size)
+        : reducing ? reduce (doc, size, arg[0], arg[1])
+        : check (sums, arg[0]);
+    unlink (tmpinput.c_str ());
+    unlink (tmpoutput.c_str ());
+    return status;
+}
@@ -1,17 +1,826 @@
 #include <locale>
 #include <iostream>
+#include <fstream>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <sstream>
+#include <cwctype>
+#include <map>
+#include <memory>
+#include <algorithm>
+#include <iterator>
+#include <cstdio>
+#include <cmath>
+#include <mutex>
+#include <thread>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 #include "markdown.hpp"
+#include "tools.hpp"
 
-int main ()
+static wchar_t const *linkkindname[]{
+    L"a", L"img", L"undefined", L"autolink", L"aref", L"imgref", L"unused",
+    L"wiki", L"extension",
+};
+
+template <typename Stream>
+static bool
+open_option (char const* arg, char const* name, Stream& file)
+{
+    std::size_t n = std::strlen (name);
+    if (std::strncmp (arg, name, n) != 0 || '=' != arg[n])
+        return false;
+    file.open (arg + n + 1);
+    file.imbue (std::locale (""));
+    return true;
+}
+
+static bool
+isadmonitionfence (std::wstring const& line)
+{
+    std::size_t i = line.find_first_not_of (L' ');
+    return i < line.size () && line.compare (i, 3, L":::") == 0;
+}
+
+/* ::: name ... ::: blocks as divs of class name */
+static markdown_block_extension
+admonition ()
+{
+    markdown_block_extension ext;
+    ext.leaders = L":";
+    ext.open = isadmonitionfence;
+    ext.close = [](std::wstring const& first, std::wstring const& line) {
+        std::size_t i = line.find_first_not_of (L" :");
+        return isadmonitionfence (line)
+            && (std::wstring::npos == i || L'\n' == line[i]);
+    };
+    ext.render = [ext](std::deque<std::wstring> const& lines) {
+        std::wstring name, inner;
+        for (wchar_t c : lines.front ())
+            if (std::iswalnum (c) || '-' == c || '_' == c)
+                name.push_back (c);
+        for (std::size_t i = 1; i < lines.size (); ++i)
+            if (i + 1 < lines.size () || ! ext.close (lines[0], lines[i]))
+                inner += lines[i];
+        std::wostringstream html;
+        html << L"<div class=\"" << name << L"\">\n";
+        markdown (inner, html);
+        html << L"</div>\n";
+        return html.str ();
+    };
+    return ext;
+}
+
+typedef std::map<std::wstring, std::wstring> refstore_type;
+
+static bool
+isrefname (wchar_t c)
+{
+    return std::iswalnum (c) || '_' == c || '-' == c;
+}
+
+/* @name or #1234 as links, with a trigger, a name and an uri per line */
+static bool
+refs_option (char const* arg, markdown_options& options)
+{
+    std::wifstream file;
+    if (! open_option (arg, "--refs", file))
+        return false;
+    std::map<wchar_t, std::shared_ptr<refstore_type>> store;
+    std::wstring name, uri;
+    while (file >> name >> uri)
+        if (name.size () > 1) {
+            if (! store[name[0]])
+                store[name[0]] = std::make_shared<refstore_type> ();
+            (*store[name[0]])[name.substr (1)] = uri;
+        }
+    for (auto& x : store) {
+        std::shared_ptr<refstore_type> refs = x.second;
+        options.inlines.push_back ({x.first, isrefname,
+            [refs](std::deque<std::wstring> const& names) {
+                std::deque<std::wstring> uris;
+                for (auto& name : names) {
+                    auto i = refs->find (name);
+                    uris.push_back (i == refs->end () ? L"" : i->second);
+                }
+                return uris;
+            }});
+    }
+    return true;
+}
+
+/* [[page]] links to page_name, with a page per line of a sorted file */
+static bool
+wiki_option (char const* arg, markdown_options& options)
+{
+    std::wifstream file;
+    if (! open_option (arg, "--wiki", file))
+        return false;
+    std::shared_ptr<std::deque<std::wstring>> index
+        = std::make_shared<std::deque<std::wstring>> ();
+    std::wstring page;
+    while (std::getline (file, page))
+        index->push_back (page);
+    options.wiki.uri = [](std::wstring const& page) {
+        std::wstring uri (page);
+        std::replace (uri.begin (), uri.end (), L' ', L'_');
+        return uri;
+    };
+    options.wiki.exists = [index](std::deque<std::wstring> const& pages) {
+        std::deque<bool> found;
+        for (auto& x : pages)
+            found.push_back (
+                std::binary_search (index->cbegin (), index->cend (), x));
+        return found;
+    };
+    return true;
+}
+
+/* uris of links and of images by a line of a or img, a tab, an uri, a
+ * tab and its replacement. those missing from FILE are kept, and told
+ * once per document.
+ */
+static bool
+rewrite_option (char const* arg, markdown_options& options)
+{
+    std::wifstream file;
+    if (! open_option (arg, "--rewrite", file))
+        return false;
+    std::shared_ptr<refstore_type> table[2]{
+        std::make_shared<refstore_type> (), std::make_shared<refstore_type> ()};
+    std::wstring line;
+    while (std::getline (file, line)) {
+        std::size_t i = line.find (L'\t');
+        std::size_t j = line.find (L'\t', i + 1);
+        if (j != std::wstring::npos)
+            (*table[line.compare (0, i, L"img") == 0])[
+                line.substr (i + 1, j - i - 1)] = line.substr (j + 1);
+    }
+    options.rewrite_uri = [table](std::wstring const& uri, bool image) {
+        auto i = table[image]->find (uri);
+        if (i != table[image]->end ())
+            return i->second;
+        std::wcerr << L"mkdown: no rewrite for " << linkkindname[image]
+                   << L" " << uri << std::endl;
+        return uri;
+    };
+    return true;
+}
+
+/* values of a template, with a name, a tab and a value per line */
+static bool
+values_option (char const* arg, std::map<std::wstring, std::wstring>& values)
+{
+    std::wifstream file;
+    if (! open_option (arg, "--values", file))
+        return false;
+    std::wstring line;
+    while (std::getline (file, line)) {
+        std::size_t i = line.find (L'\t');
+        if (i != std::wstring::npos)
+            values[line.substr (0, i)] = line.substr (i + 1);
+    }
+    return true;
+}
+
+typedef std::chrono::steady_clock::time_point time_point;
+
+/* stages of mkdown around those of markdown_stage */
+enum { STAGE_READ = MDSTAGE_INLINE + 1, STAGE_WRITE };
+
+static char const* stagename[]{
+    "split_lines", "parse_block", "print_block", "parse_inline",
+    "read", "write",
+};
+
+struct tracespan_type {
+    std::string const* file;
+    int stage;
+    time_point start;
+    time_point end;
+};
+
+/* spans of a thread, appended by it alone without locks, and merged
+ * after the renders
+ */
+struct tracebuffer_type {
+    long tid;
+    std::deque<tracespan_type> span;
+};
+
+static std::mutex tracemutex;                   // of tracebuffers
+static std::deque<tracebuffer_type> tracebuffers;
+static thread_local tracebuffer_type* tracebuffer = nullptr;
+static thread_local std::string const* tracefile = nullptr;
+
+static long
+thread_id ()
+{
+#ifdef __linux__
+    return syscall (SYS_gettid);
+#else
+    return std::hash<std::thread::id> () (std::this_thread::get_id ());
+#endif
+}
+
+/* the rendering thread calls markdown_options::trace */
+static void
+trace_span (int stage, time_point start, time_point end)
+{
+    if (! tracebuffer) {
+        std::lock_guard<std::mutex> lock (tracemutex);
+        tracebuffers.push_back ({thread_id (), {}});
+        tracebuffer = &tracebuffers.back ();
+    }
+    tracebuffer->span.push_back ({tracefile, stage, start, end});
+}
+
+static std::string
+json_string (std::string const& str)
+{
+    std::string json (1, '"');
+    for (unsigned char c : str)
+        if ('"' == c || '\\' == c)
+            json.append (1, '\\').append (1, c);
+        else if (c < ' ')
+            json.append ("\\u00").append (1, "0123456789abcdef"[c >> 4])
+                .append (1, "0123456789abcdef"[c & 15]);
+        else
+            json.append (1, c);
+    json.append (1, '"');
+    return json;
+}
+
+/* nanoseconds as microseconds with three decimals */
+static void
+append_micros (std::string& output, long long ns)
+{
+    char buf[24];
+    char* p = buf + sizeof (buf);
+    long long us = ns / 1000;
+    int frac = ns % 1000;
+    for (int i = 0; i < 3; ++i, frac /= 10)
+        *--p = '0' + frac % 10;
+    *--p = '.';
+    do
+        *--p = '0' + us % 10;
+    while (us /= 10);
+    output.append (p, buf + sizeof (buf));
+}
+
+/* complete events of the chrome trace event format in microseconds,
+ * of each thread in turn, formatted without printf to keep the tracer
+ * cheap. file names are written as bytes, which are utf-8 on most
+ * systems.
+ */
+static void
+print_trace (time_point epoch, std::ostream& output)
+{
+    using nano = std::chrono::nanoseconds;
+    std::string json ("{\"traceEvents\":[");
+    std::string const* file = nullptr;
+    std::string name = json_string ("-");   // escaped once for its spans
+    char const* sep = "\n";
+    std::lock_guard<std::mutex> lock (tracemutex);
+    std::size_t spans = 0;
+    for (auto& t : tracebuffers)
+        spans += t.span.size ();
+    json.reserve (128 * spans);
+    for (auto& t : tracebuffers) {
+        std::string tid = std::to_string (t.tid);
+        for (auto& x : t.span) {
+            if (x.file != file) {
+                file = x.file;
+                name = json_string (file ? *file : "-");
+            }
+            json.append (sep).append ("{\"name\":\"")
+                .append (stagename[x.stage])
+                .append ("\",\"ph\":\"X\",\"pid\":1,\"tid\":").append (tid)
+                .append (",\"ts\":");
+            append_micros (json, std::chrono::duration_cast<nano> (
+                x.start - epoch).count ());
+            json.append (",\"dur\":");
+            append_micros (json, std::chrono::duration_cast<nano> (
+                x.end - x.start).count ());
+            json.append (",\"args\":{\"file\":").append (name).append ("}}");
+            sep = ",\n";
+        }
+    }
+    json.append ("\n]}\n");
+    output.write (json.data (), json.size ());
+}
+
+enum { NCOUNTER = 6, NSTAGE = MDSTAGE_INLINE + 1 };
+
+static char const* countername[NCOUNTER]{
+    "cycles", "instructions", "branch-misses", "l1d-misses", "llc-misses",
+    "page-faults",
+};
+
+/* values of a stage running, and of the stages nested in it */
+struct counterframe_type {
+    int stage;
+    unsigned long long start[NCOUNTER];
+    unsigned long long child[NCOUNTER];
+};
+
+/* perf_event_open counters of the stages on the main thread, as a group
+ * of those the kernel permits. the others are not counted.
+ */
+struct counters_type {
+    int fd;                         // group leader, or -1
+    int slot[NCOUNTER];             // in the group, or -1
+    int n;
+    std::deque<counterframe_type> frame;
+    unsigned long long total[NSTAGE][NCOUNTER];
+    std::size_t calls[NSTAGE];
+    std::size_t bytes;              // of the inputs in utf-8
+};
+
+static counters_type counters;
+
+static void
+counters_open ()
+{
+    counters.fd = -1;
+    counters.n = 0;
+#ifdef __linux__
+    static const std::pair<unsigned, unsigned long long> event[NCOUNTER]{
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D
+            | PERF_COUNT_HW_CACHE_OP_READ << 8
+            | PERF_COUNT_HW_CACHE_RESULT_MISS << 16},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+    };
+    for (int i = 0; i < NCOUNTER; ++i) {
+        perf_event_attr attr;
+        std::memset (&attr, 0, sizeof (attr));
+        attr.size = sizeof (attr);
+        attr.type = event[i].first;
+        attr.config = event[i].second;
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        int fd = syscall (SYS_perf_event_open, &attr, 0, -1, counters.fd, 0);
+        counters.slot[i] = fd < 0 ? -1 : counters.n++;
+        if (fd >= 0 && counters.fd < 0)
+            counters.fd = fd;
+    }
+#else
+    std::fill (counters.slot, counters.slot + NCOUNTER, -1);
+#endif
+}
+
+static void
+counters_read (unsigned long long value[NCOUNTER])
+{
+    unsigned long long buf[1 + NCOUNTER]{};
+#ifdef __linux__
+    if (counters.fd >= 0 && read (counters.fd, buf, sizeof (buf)) < 0)
+        buf[0] = 0;
+#endif
+    for (int i = 0; i < NCOUNTER; ++i)
+        value[i] = counters.slot[i] < 0 ? 0 : buf[1 + counters.slot[i]];
+}
+
+static void
+counters_enter (int stage)
+{
+    counters.frame.push_back ({stage, {}, {}});
+    counters_read (counters.frame.back ().start);
+}
+
+/* adds the values of a stage less those of the stages nested in it */
+static void
+counters_leave (int stage)
+{
+    if (counters.frame.empty () || counters.frame.back ().stage != stage)
+        return;
+    unsigned long long now[NCOUNTER];
+    counters_read (now);
+    counterframe_type& x = counters.frame.back ();
+    for (int i = 0; i < NCOUNTER; ++i) {
+        unsigned long long delta = now[i] - x.start[i];
+        counters.total[stage][i] += delta - x.child[i];
+        if (counters.frame.size () > 1)
+            counters.frame[counters.frame.size () - 2].child[i] += delta;
+    }
+    ++counters.calls[stage];
+    counters.frame.pop_back ();
+}
+
+/* a stage per line, with instructions per byte and branch misses per
+ * kilobyte of the inputs. - for counters the kernel does not permit.
+ */
+static void
+print_counters (std::ostream& output)
+{
+    output << "stage\tcalls";
+    for (auto name : countername)
+        output << "\t" << name;
+    output << "\tinstructions/byte\tbranch-misses/KB\n";
+    double bytes = counters.bytes > 0 ? counters.bytes : 1;
+    for (int stage = 0; stage < NSTAGE; ++stage) {
+        unsigned long long const* total = counters.total[stage];
+        output << stagename[stage] << "\t" << counters.calls[stage];
+        for (int i = 0; i < NCOUNTER; ++i)
+            if (counters.slot[i] < 0)
+                output << "\t-";
+            else
+                output << "\t" << total[i];
+        if (counters.slot[1] < 0)
+            output << "\t-";
+        else
+            output << "\t" << total[1] / bytes;
+        if (counters.slot[2] < 0)
+            output << "\t-";
+        else
+            output << "\t" << total[2] * 1024 / bytes;
+        output << "\n";
+    }
+}
+
+static char const* allocname[MDALLOC_KINDS]{
+    "lines", "blocks", "inlines", "refdict", "strings",
+};
+
+static void
+print_alloc (char const* name, markdown_alloc const& x, std::wostream& output)
+{
+    output << name << L"\t" << x.count << L"\t" << x.bytes
+           << L"\t" << x.peak << L"\n";
+}
+
+/* allocations, bytes and peak live bytes by container kind and stage */
+static void
+print_memory (markdown_memory const& memory, std::wostream& output)
+{
+    output << L"kind\tcount\tbytes\tpeak\n";
+    for (int k = 0; k < MDALLOC_KINDS; ++k)
+        print_alloc (allocname[k], memory.kind[k], output);
+    for (int stage = 0; stage < NSTAGE; ++stage)
+        print_alloc (stagename[stage], memory.stage[stage], output);
+    print_alloc ("total", memory.total, output);
+    output << L"live\t-\t" << memory.live << L"\t-\n";
+}
+
+/* render times of the documents of a batch for --slow */
+struct slowdoc_type {
+    std::string const* file;
+    double seconds;
+    double stage[STAGE_WRITE + 1];  // without the stages nested in them
+    markdown_profile profile;
+};
+
+/* a stage running, and the seconds of the stages nested in it */
+struct slowframe_type {
+    int stage;
+    double child;
+};
+
+static std::deque<slowdoc_type> slowdocs;
+static std::deque<slowframe_type> slowframes;
+
+static void
+slow_enter (int stage)
+{
+    slowframes.push_back ({stage, 0});
+}
+
+/* adds the seconds of a stage less those of the stages nested in it,
+ * such as the stages of included files in split_lines
+ */
+static void
+slow_span (int stage, time_point start, time_point end)
+{
+    double seconds = std::chrono::duration<double> (end - start).count ();
+    double child = 0;
+    if (! slowframes.empty () && slowframes.back ().stage == stage) {
+        child = slowframes.back ().child;
+        slowframes.pop_back ();
+    }
+    slowdocs.back ().stage[stage] += seconds - child;
+    if (! slowframes.empty ())
+        slowframes.back ().child += seconds;
+}
+
+/* the documents taking threshold seconds or more, or else those over
+ * the percentile of the times, slowest first, with their longest stage
+ * and the work of the parser on them
+ */
+static void
+print_slow (double threshold, double percentile, std::ostream& output)
+{
+    std::deque<slowdoc_type const*> doc;
+    for (auto& x : slowdocs)
+        doc.push_back (&x);
+    std::sort (doc.begin (), doc.end (),
+        [](slowdoc_type const* a, slowdoc_type const* b) {
+            return a->seconds > b->seconds;
+        });
+    if (threshold < 0 && ! doc.empty ()) {
+        double n = std::ceil (doc.size () * (100 - percentile) / 100);
+        std::size_t k = std::min<std::size_t> (std::max (n, 1.0), doc.size ());
+        threshold = doc[k - 1]->seconds;
+    }
+    output << "file\tms\tstage\tstage_ms\tdepth\tfallbacks\tsearched"
+        "\tdelimiters\n";
+    for (auto x : doc) {
+        if (x->seconds < threshold)
+            break;
+        int top = std::max_element (x->stage, x->stage + STAGE_WRITE + 1)
+            - x->stage;
+        output << *x->file << "\t" << x->seconds * 1e3
+               << "\t" << stagename[top] << "\t" << x->stage[top] * 1e3
+               << "\t" << x->profile.depth << "\t" << x->profile.fallbacks
+               << "\t" << x->profile.searched
+               << "\t" << x->profile.delimiters << "\n";
+    }
+}
+
+static bool
+read_file (std::string const& path, std::wstring& content)
+{
+    std::wifstream file (path);
+    if (! file)
+        return false;
+    file.imbue (std::locale (""));
+    content.assign (std::istreambuf_iterator<wchar_t> (file),
+        std::istreambuf_iterator<wchar_t> ());
+    return true;
+}
+
+/* doc.md to doc.html */
+static std::string
+html_path (std::string const& path)
+{
+    std::size_t n = path.size ();
+    if (n > 3 && path.compare (n - 3, 3, ".md") == 0)
+        return path.substr (0, n - 3) + ".html";
+    return path + ".html";
+}
+
+static void
+render_stdin (markdown_sink const& sink, markdown_options const& options,
+    std::size_t chunksize, std::size_t pullsize)
+{
+    std::deque<std::wstring> chunks (1);
+    int ch;
+    time_point t0 = std::chrono::steady_clock::now ();
+    while ((ch = std::wcin.get ()) > 0) {
+        if (chunksize > 0 && chunks.back ().size () >= chunksize)
+            chunks.push_back (std::wstring ());
+        chunks.back ().push_back (ch);
+    }
+    if (options.trace)
+        options.trace (STAGE_READ, t0, std::chrono::steady_clock::now ());
+    if (options.trace_enter)
+        for (auto& x : chunks)
+            counters.bytes += utf8_size (x);
+    if (chunksize > 0)
+        markdown (chunks, sink, options);
+    else if (pullsize > 0) {
+        markdown_reader reader (chunks.back (), options, sink.memory);
+        std::vector<wchar_t> buf (pullsize);
+        std::size_t n;
+        while ((n = reader.read (&buf[0], buf.size ())) > 0)
+            sink.html->write (&buf[0], n);
+    }
+    else
+        markdown (chunks.back (), sink, options);
+    time_point t1 = std::chrono::steady_clock::now ();
+    sink.html->flush ();
+    if (options.trace)
+        options.trace (STAGE_WRITE, t1, std::chrono::steady_clock::now ());
+}
+
+/* compiles stdin as a template, and renders it with values */
+static bool
+render_template (std::map<std::wstring, std::wstring> const& values,
+    std::wostream& output)
+{
+    std::wstring input;
+    int ch;
+    while ((ch = std::wcin.get ()) > 0)
+        input.push_back (ch);
+    markdown_template tmpl;
+    if (! markdown_compile (input, tmpl))
+        return false;
+    markdown_render (tmpl, values, output);
+    return true;
+}
+
+int main (int argc, char* argv[])
 {
     std::locale::global (std::locale (""));
     std::wcin.imbue (std::locale (""));
     std::wcout.imbue (std::locale (""));
 
-    std::wstring buf;
-    int ch;
-    while ((ch = std::wcin.get ()) > 0)
-        buf.push_back (ch);
-    markdown (buf, std::wcout);
+    std::wofstream htmlfile, textfile, outlinefile, linksfile, frontmatterfile;
+    std::wofstream statsfile;
+    std::ofstream tracejson, countersfile, slowfile;
+    double slowms = -1;
+    double slowpercentile = 99;
+    time_point epoch = std::chrono::steady_clock::now ();
+    markdown_frontmatter frontmatter {0, {}};
+    markdown_stats stats {};
+    markdown_memory memory {};
+    std::wofstream memoryfile;
+    std::deque<markdown_heading> outline;
+    std::deque<markdown_link> links;
+    markdown_sink sink {&std::wcout};
+    std::size_t chunksize = 0;
+    std::size_t pullsize = 0;
+    markdown_options options;
+    std::map<std::wstring, std::wstring> values;
+    bool templating = false;
+    std::deque<std::string> files;
+    for (int i = 1; i < argc; ++i) {
+        if (open_option (argv[i], "--html", htmlfile))
+            sink.html = &htmlfile;
+        else if (open_option (argv[i], "--text", textfile))
+            sink.text = &textfile;
+        else if (open_option (argv[i], "--outline", outlinefile))
+            sink.outline = &outline;
+        else if (open_option (argv[i], "--links", linksfile))
+            sink.links = &links;
+        else if (open_option (argv[i], "--frontmatter", frontmatterfile))
+            sink.frontmatter = &frontmatter;
+        else if (open_option (argv[i], "--stats", statsfile))
+            sink.stats = &stats;
+        else if (open_option (argv[i], "--memory", memoryfile))
+            sink.memory = &memory;
+        else if (open_option (argv[i], "--trace", tracejson))
+            ;
+        else if (open_option (argv[i], "--counters", countersfile))
+            ;
+        else if (open_option (argv[i], "--slow", slowfile))
+            ;
+        else if (std::strncmp (argv[i], "--slow-ms=", 10) == 0)
+            slowms = std::atof (argv[i] + 10);
+        else if (std::strncmp (argv[i], "--slow-percentile=", 18) == 0)
+            slowpercentile = std::atof (argv[i] + 18);
+        else if (std::strncmp (argv[i], "--chunk=", 8) == 0)
+            chunksize = std::strtoul (argv[i] + 8, nullptr, 10);
+        else if (std::strncmp (argv[i], "--pull=", 7) == 0)
+            pullsize = std::strtoul (argv[i] + 7, nullptr, 10);
+        else if (std::strcmp (argv[i], "--admonition") == 0)
+            options.blocks.push_back (admonition ());
+        else if (refs_option (argv[i], options))
+            ;
+        else if (wiki_option (argv[i], options))
+            ;
+        else if (rewrite_option (argv[i], options))
+            ;
+        else if (values_option (argv[i], values))
+            templating = true;
+        else if (std::strcmp (argv[i], "--emoji") == 0)
+            options.emoji = true;
+        else if (std::strcmp (argv[i], "--smart") == 0)
+            options.smart = true;
+        else if (std::strcmp (argv[i], "--math") == 0)
+            options.math = true;
+        else if (std::strcmp (argv[i], "--include") == 0)
+            options.include.read = read_file;
+        else if (std::strncmp (argv[i], "--", 2) != 0)
+            files.push_back (argv[i]);
+        else {
+            std::cerr << "usage: mkdown [--html=FILE] [--text=FILE]"
+                " [--outline=FILE] [--links=FILE] [--frontmatter=FILE]"
+                " [--stats=FILE] [--memory=FILE] [--trace=FILE]"
+                " [--counters=FILE]"
+                " [--slow=FILE] [--slow-ms=MS | --slow-percentile=P]"
+                " [--chunk=SIZE] [--pull=SIZE]"
+                " [--admonition] [--refs=FILE] [--emoji]"
+                " [--smart] [--math] [--wiki=FILE] [--include]"
+                " [--rewrite=FILE] [--values=FILE]"
+                " < input | FILE..."
+                << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (slowfile.is_open () && files.empty ()) {
+        std::cerr << "mkdown: --slow needs FILE arguments" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if ((chunksize > 0 || pullsize > 0) && ! files.empty ()) {
+        std::cerr << "mkdown: --chunk and --pull read stdin" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (chunksize > 0 && pullsize > 0) {
+        std::cerr << "mkdown: --chunk and --pull exclude each other"
+            << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (pullsize > 0 && (sink.text || sink.outline || sink.links
+            || sink.frontmatter || sink.stats)) {
+        std::cerr << "mkdown: --pull writes only html, --memory and --trace"
+            << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (templating) {
+        if (! files.empty ()) {
+            std::cerr << "mkdown: --values reads a template from stdin"
+                << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (! render_template (values, *sink.html)) {
+            std::cerr << "mkdown: cannot compile the template" << std::endl;
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+    bool tracing = tracejson.is_open ();
+    bool counting = countersfile.is_open ();
+    bool slowing = slowfile.is_open ();
+    if (counting)
+        counters_open ();
+    if (counting || slowing)
+        options.trace_enter = [counting, slowing](int stage) {
+            if (counting)
+                counters_enter (stage);
+            if (slowing)
+                slow_enter (stage);
+        };
+    if (tracing || counting || slowing)
+        options.trace = [tracing, counting, slowing](int stage,
+                time_point start, time_point end) {
+            if (counting)
+                counters_leave (stage);
+            if (tracing)
+                trace_span (stage, start, end);
+            if (slowing)
+                slow_span (stage, start, end);
+        };
+    if (! files.empty ())
+        options.include.cache = markdown_make_include_cache ();
+    for (auto& path : files) {
+        std::wstring input;
+        tracefile = &path;
+        if (slowing) {
+            slowdocs.push_back ({&path, 0, {}, {}});
+            sink.profile = &slowdocs.back ().profile;
+        }
+        time_point t0 = std::chrono::steady_clock::now ();
+        if (! read_file (path, input)) {
+            std::cerr << "mkdown: cannot read " << path << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (options.trace)
+            options.trace (STAGE_READ, t0, std::chrono::steady_clock::now ());
+        if (counting)
+            counters.bytes += utf8_size (input);
+        std::wofstream html (html_path (path));
+        html.imbue (std::locale (""));
+        sink.html = &html;
+        options.include.path = path;
+        markdown (input, sink, options);
+        time_point t1 = std::chrono::steady_clock::now ();
+        html.close ();
+        time_point t2 = std::chrono::steady_clock::now ();
+        if (options.trace)
+            options.trace (STAGE_WRITE, t1, t2);
+        if (slowing)
+            slowdocs.back ().seconds
+                = std::chrono::duration<double> (t2 - t0).count ();
+    }
+    tracefile = nullptr;
+
+    if (files.empty ())
+        render_stdin (sink, options, chunksize, pullsize);
+    for (auto& x : outline)
+        outlinefile << x.level << L"\t" << x.text << L"\n";
+    if (sink.frontmatter)
+        frontmatterfile << frontmatter.size << L"\n";
+    for (auto& x : frontmatter.field)
+        frontmatterfile << x.first << L"\t" << x.second << L"\n";
+    if (sink.memory)
+        print_memory (memory, memoryfile);
+    if (sink.stats)
+        statsfile << L"words\t" << stats.words << L"\n"
+                  << L"cjk\t" << stats.cjk << L"\n"
+                  << L"headings\t" << stats.headings << L"\n"
+                  << L"links\t" << stats.links << L"\n"
+                  << L"images\t" << stats.images << L"\n"
+                  << L"codeblocks\t" << stats.codeblocks << L"\n"
+                  << L"codelines\t" << stats.codelines << L"\n"
+                  << L"minutes\t" << markdown_reading_minutes (stats) << L"\n";
+    for (auto& x : links)
+        linksfile << x.offset << L"\t" << linkkindname[x.kind]
+                  << L"\t" << x.uri << L"\n";
+    if (tracing)
+        print_trace (epoch, tracejson);
+    if (counting)
+        print_counters (countersfile);
+    if (slowing)
+        print_slow (slowms / 1e3, slowpercentile, slowfile);
     return EXIT_SUCCESS;
 }
@@ -41,6 +41,71 @@
 #include <string>
 #include <algorithm>
 #include <locale>
+#include <sstream>
+#include <vector>
+#include <cwctype>
+#include <set>
+#include <cstdint>
+#include <type_traits>
+#include "markdown.hpp"
+
+/* extensions, compiled out with -DMARKDOWN_RUBY=0 and so on.
+ * a disabled extension is removed from the dispatch of split_lines
+ * and parse_inline_loop by constant folding.
+ */
+#ifndef MARKDOWN_RUBY
+#define MARKDOWN_RUBY 1         // [base]^(annotation)
+#endif
+#ifndef MARKDOWN_FENCES
+#define MARKDOWN_FENCES 1       // ``` code blocks
+#endif
+#ifndef MARKDOWN_BLOCKHTML
+#define MARKDOWN_BLOCKHTML 1    // html blocks
+#endif
+#ifndef MARKDOWN_REFDEFS
+#define MARKDOWN_REFDEFS 1      // [id]: uri "title"
+#endif
+
+/* USDT probes of provider mkdown, nops until a tracer attaches them.
+ * built in where <sys/sdt.h> exists, and compiled out with
+ * -DMARKDOWN_PROBES=0. offsets and sizes are in characters, and those
+ * of link__reparse are in the inline run of parse__inline__start.
+ */
+#ifndef MARKDOWN_PROBES
+#if defined (__has_include)
+#if __has_include (<sys/sdt.h>)
+#define MARKDOWN_PROBES 1
+#endif
+#endif
+#endif
+#ifndef MARKDOWN_PROBES
+#define MARKDOWN_PROBES 0
+#endif
+#if MARKDOWN_PROBES
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define MARKDOWN_PROBE(...) STAP_PROBEV (mkdown, __VA_ARGS__)
+/* semaphores counted up by tracers while they attach the probes */
+#define MARKDOWN_SEMAPHORE(name) \
+    unsigned short mkdown_##name##_semaphore __attribute__ ((section (".probes")))
+#define MARKDOWN_PROBE_ENABLED(name) \
+    __builtin_expect (mkdown_##name##_semaphore != 0, 0)
+MARKDOWN_SEMAPHORE (markdown__start);
+MARKDOWN_SEMAPHORE (markdown__done);
+MARKDOWN_SEMAPHORE (split__lines__start);
+MARKDOWN_SEMAPHORE (split__lines__done);
+MARKDOWN_SEMAPHORE (parse__block__start);
+MARKDOWN_SEMAPHORE (parse__block__deep);
+MARKDOWN_SEMAPHORE (parse__block__done);
+MARKDOWN_SEMAPHORE (parse__inline__start);
+MARKDOWN_SEMAPHORE (parse__inline__done);
+MARKDOWN_SEMAPHORE (blockcode__unclosed);
+MARKDOWN_SEMAPHORE (link__reparse);
+#else
+template <typename... T> static void markdown_probe_nop (T const&...) {}
+#define MARKDOWN_PROBE(name, ...) (false ? markdown_probe_nop (__VA_ARGS__) : (void) 0)
+#define MARKDOWN_PROBE_ENABLED(name) false
+#endif
 
 static const std::wstring blocktag (
     L" blockquote del div dl fieldset figure form h1 h2 h3 h4 h5 h6"
@@ -54,7 +119,8 @@ enum {
     CODE,
     TEXT,
     INLINE,
-    LINKID, URI,
+    LINKID, URI, EXTREF, EMOJI, WIKILINK,
+    MATH, DMATH, MATHBLOCK, INCLUDE,
     /* inline HTML markup */
     SABEGIN, TITLE, SAEND,
     IMGBEGIN, ALT, IMGEND,
@@ -84,7 +150,8 @@ static wchar_t const *kindname[]{
     L"CODE",
     L"TEXT",
     L"INLINE",
-    L"LINKID", L"URI",
+    L"LINKID", L"URI", L"EXTREF", L"EMOJI", L"WIKILINK",
+    L"MATH", L"DMATH", L"MATHBLOCK", L"INCLUDE",
     /* inline HTML markup */
     L"<a href=\"", L"\" title=\"", L"\">",
     L"<img src=\"", L"\" alt=\"", L"\" />",
@@ -120,40 +187,429 @@ struct reflink_type {
     std::wstring id;
     std::wstring uri;
     std::wstring title;
+    std::size_t offset;
+    bool used;
 };
 
 struct nest_type {
     std::size_t pos;
     int n;
+    char_iterator eos;      // of the scan of brackets
+};
+
+/* live bytes of a document for markdown_sink::memory */
+struct allocstate_type;
+
+struct alloccount_type {
+    allocstate_type* state;
+    int kind;
 };
 
-typedef std::deque<token_type>::const_iterator token_iterator;
-typedef std::deque<token_type>::const_iterator line_iterator;
-typedef std::map<std::wstring, reflink_type> refdict_type;
+struct allocstate_type {
+    markdown_memory* memory;
+    int stage;                              // innermost, or -1
+    std::size_t live;
+    std::size_t kindlive[MDALLOC_KINDS];
+    alloccount_type count[MDALLOC_KINDS];
+};
 
 static void
-split_lines (std::wstring const &input, std::deque<token_type>& output,
-    refdict_type& dict);
-static void parse_block (std::deque<token_type> const& input,
-    std::deque<token_type>& output);
+alloc_add (markdown_alloc& x, std::size_t n, std::size_t live)
+{
+    ++x.count;
+    x.bytes += n;
+    x.peak = std::max (x.peak, live);
+}
+
 static void
-print_block (std::deque<token_type> const& input, std::wostream& output,
-    refdict_type const& dict);
+alloc_count (alloccount_type const& c, std::size_t n)
+{
+    allocstate_type& state = *c.state;
+    markdown_memory& memory = *state.memory;
+    state.live += n;
+    state.kindlive[c.kind] += n;
+    memory.live += n;
+    alloc_add (memory.kind[c.kind], n, state.kindlive[c.kind]);
+    alloc_add (memory.total, n, state.live);
+    if (state.stage >= 0)
+        alloc_add (memory.stage[state.stage], n, state.live);
+}
 
-void markdown (std::wstring const& input, std::wostream& output)
+static void
+alloc_release (alloccount_type const& c, std::size_t n)
+{
+    c.state->live -= n;
+    c.state->kindlive[c.kind] -= n;
+    c.state->memory->live -= n;
+}
+
+/* std::allocator counting into a kind of a document, when given one */
+template <typename T>
+struct counting_allocator {
+    typedef T value_type;
+    typedef std::true_type propagate_on_container_copy_assignment;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    alloccount_type const* count;
+
+    counting_allocator (alloccount_type const* count = nullptr) : count (count) {}
+    template <typename U>
+    counting_allocator (counting_allocator<U> const& x) : count (x.count) {}
+
+    T* allocate (std::size_t n)
+    {
+        if (count)
+            alloc_count (*count, n * sizeof (T));
+        return std::allocator<T> ().allocate (n);
+    }
+
+    void deallocate (T* p, std::size_t n)
+    {
+        if (count)
+            alloc_release (*count, n * sizeof (T));
+        std::allocator<T> ().deallocate (p, n);
+    }
+};
+
+template <typename T, typename U>
+static bool
+operator== (counting_allocator<T> const& a, counting_allocator<U> const& b)
+{
+    return a.count == b.count;
+}
+
+template <typename T, typename U>
+static bool
+operator!= (counting_allocator<T> const& a, counting_allocator<U> const& b)
 {
-    std::deque<token_type> pass1;
-    std::deque<token_type> pass2;
+    return a.count != b.count;
+}
+
+typedef std::deque<token_type, counting_allocator<token_type>> tokens_type;
+typedef std::basic_string<wchar_t, std::char_traits<wchar_t>,
+    counting_allocator<wchar_t>> tempwstring_type;
+typedef std::basic_string<char, std::char_traits<char>,
+    counting_allocator<char>> tempstring_type;
+
+typedef tokens_type::const_iterator token_iterator;
+typedef tokens_type::const_iterator line_iterator;
+typedef std::map<std::wstring, reflink_type, std::less<std::wstring>,
+    counting_allocator<std::pair<std::wstring const, reflink_type>>> refdict_type;
+
+/* EXTREF or WIKILINK at an offset of html, resolved after rendering */
+struct extref_type {
+    std::streamoff offset;
+    int kind;
+    std::wstring name;      // with the trigger, or the page
+    std::wstring label;
+    std::size_t source;     // of the construct in the input, for sink.links
+};
+
+/* a file read once for the documents sharing the cache */
+struct includesource_type {
+    bool readable;
+    std::wstring content;
+};
+
+/* an included file rendered once for the same options, with the outputs
+ * of its sinks, given to the sinks of the includers
+ */
+struct includefile_type {
+    bool rendered;          // cached, when no include in it was refused
+    std::wstring html;
+    std::wstring text;
+    std::deque<markdown_heading> outline;
+    std::deque<markdown_link> links;
+    markdown_stats stats;
+};
+
+/* sources by path, renders by path and options, and the paths being
+ * included now for detecting cycles
+ */
+struct markdown_include_cache {
+    std::map<std::string, includesource_type> source;
+    std::map<std::string, includefile_type> file;
+    std::set<std::string> active;
+    std::size_t refused;    // includes of files being included already
+};
+
+struct document_type;
+
+/* block recognizers return dot when the line does not start the block */
+typedef line_iterator (*block_parser_type) (line_iterator const dot,
+    line_iterator const dol, tokens_type& output,
+    document_type& doc);
+
+struct blockrule_type {
+    block_parser_type parse;
+    markdown_block_extension const* ext;    // nullptr for built-ins
+};
+
+/* rules by the first character of a line after at most three spaces.
+ * characters over 127 share rule[0].
+ */
+struct blocktable_type {
+    std::vector<blockrule_type> rule[128];
+};
+
+/* a [ in each context to its ] or to eos when unclosed, by the eos of
+ * the scan
+ */
+struct bracket_type {
+    char_iterator end[4];
+    char_iterator scaneos[4];
+    int contexts;           // bits of those scanned
+};
+
+/* per document state shared by the inline parser and the output builders */
+struct document_type {
     refdict_type dict;
-    split_lines (input, pass1, dict);
-    parse_block (pass1, pass2);
-    print_block (pass2, output, dict);
+    markdown_sink const& sink;
+    markdown_options const& options;
+    std::map<std::wstring, std::wstring> rewritten[2];
+    std::map<char_iterator, std::wstring> undefined;
+    bool textbol;
+    std::map<wchar_t const*, std::size_t> origin;   // input buffers
+    char_iterator srcbegin;
+    std::deque<std::pair<std::size_t, char_iterator>> segment;
+    std::deque<std::pair<wchar_t, int>>* holes;     // with their kinds
+    int heading;
+    std::unique_ptr<blocktable_type> blocktable;    // with extensions
+    std::deque<std::wstring> blockhtml;             // by extensions, include
+    std::wstring ccls;                              // inline specials
+    std::wstring triggers;                          // of inline extensions
+    std::deque<extref_type> extref;
+    wchar_t smartprev;                              // for quote pairing
+    std::vector<std::size_t> dollar[2];             // closing $ and $$
+    /* scans of [ in the inline input by offset, made on the first [ */
+    char_iterator bracketbos;
+    char_iterator bracketeos;
+    std::vector<std::uint32_t> bracketslot;         // 1 + index of brackets
+    std::deque<bracket_type> brackets;
+    bool statsword;                                 // in a word
+    std::shared_ptr<markdown_include_cache> includecache;
+    /* INCLUDE tokens in order, with the offsets of their lines */
+    std::deque<std::pair<includefile_type const*, std::size_t>> included;
+    std::size_t includenext;                        // to print
+    std::deque<includefile_type> includeonce;       // not cached
+    int blockdepth;                                 // of parse_block
+    markdown_profile profile;                       // for the sink
+    allocstate_type alloc;
+};
+
+/* an allocator of a kind, counting only for markdown_sink::memory */
+static alloccount_type const*
+alloc_kind (document_type const& doc, int kind)
+{
+    return doc.alloc.memory ? &doc.alloc.count[kind] : nullptr;
+}
+
+static void
+alloc_begin (document_type& doc)
+{
+    doc.alloc.memory = doc.sink.memory;
+    doc.alloc.stage = -1;
+    for (int k = 0; k < MDALLOC_KINDS; ++k)
+        doc.alloc.count[k] = {&doc.alloc, k};
+    if (doc.alloc.memory)
+        doc.dict = refdict_type (alloc_kind (doc, MDALLOC_REFDICT));
+}
+
+/* alloc_begin for the first container of a document constructed in a
+ * member initializer list, after the document
+ */
+static alloccount_type const*
+alloc_begin_kind (document_type& doc, int kind)
+{
+    alloc_begin (doc);
+    return alloc_kind (doc, kind);
+}
+
+typedef std::chrono::steady_clock::time_point time_point;
+
+static time_point
+trace_start (document_type& doc, int stage)
+{
+    doc.alloc.stage = stage;
+    if (doc.options.trace_enter)
+        doc.options.trace_enter (stage);
+    return doc.options.trace ? std::chrono::steady_clock::now () : time_point ();
+}
+
+static void
+trace_end (document_type& doc, int stage, time_point const start)
+{
+    doc.alloc.stage = MDSTAGE_INLINE == stage ? MDSTAGE_PRINT : -1;
+    if (doc.options.trace)
+        doc.options.trace (stage, start, std::chrono::steady_clock::now ());
+}
+
+/* nested parse_block calls beyond this fire the block__deep probe */
+static const int deepblock = 8;
+
+/* rope - a sequence of chunks as an input without concatenation.
+ * split_lines runs over rope_iterator, and copies to a carry only
+ * those tokens across the boundaries of chunks.
+ */
+struct rope_type {
+    std::deque<std::wstring const*> chunk;
+    std::deque<std::ptrdiff_t> offset;      // chunk[k] at offset[k], and size
+    std::deque<std::wstring> carry;
+    std::deque<std::ptrdiff_t> carryoffset;
+};
+
+struct rope_iterator {
+    typedef std::random_access_iterator_tag iterator_category;
+    typedef wchar_t value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef wchar_t const* pointer;
+    typedef wchar_t const& reference;
+
+    rope_type* rope;
+    std::ptrdiff_t pos;
+    mutable std::size_t k;  // chunk of the last access
+
+    wchar_t const& at (std::ptrdiff_t const i) const
+    {
+        if (i < rope->offset[k] || rope->offset[k + 1] <= i)
+            k = std::upper_bound (rope->offset.cbegin (), rope->offset.cend (), i)
+              - rope->offset.cbegin () - 1;
+        return (*rope->chunk[k])[i - rope->offset[k]];
+    }
+
+    wchar_t const& operator* () const { return at (pos); }
+    wchar_t const& operator[] (std::ptrdiff_t n) const { return at (pos + n); }
+    rope_iterator& operator++ () { ++pos; return *this; }
+    rope_iterator& operator-- () { --pos; return *this; }
+    rope_iterator operator++ (int) { rope_iterator t = *this; ++pos; return t; }
+    rope_iterator operator-- (int) { rope_iterator t = *this; --pos; return t; }
+    rope_iterator& operator+= (std::ptrdiff_t n) { pos += n; return *this; }
+    rope_iterator& operator-= (std::ptrdiff_t n) { pos -= n; return *this; }
+    rope_iterator operator+ (std::ptrdiff_t n) const { return {rope, pos + n, k}; }
+    rope_iterator operator- (std::ptrdiff_t n) const { return {rope, pos - n, k}; }
+    std::ptrdiff_t operator- (rope_iterator const& x) const { return pos - x.pos; }
+    bool operator== (rope_iterator const& x) const { return pos == x.pos; }
+    bool operator!= (rope_iterator const& x) const { return pos != x.pos; }
+    bool operator< (rope_iterator const& x) const { return pos < x.pos; }
+    bool operator> (rope_iterator const& x) const { return pos > x.pos; }
+    bool operator<= (rope_iterator const& x) const { return pos <= x.pos; }
+    bool operator>= (rope_iterator const& x) const { return pos >= x.pos; }
+};
+
+template <typename Iter>
+static void split_lines (Iter const bos, Iter const eos,
+    tokens_type& output, document_type& doc);
+
+static void parse_block (tokens_type const& input,
+    tokens_type& output, document_type& doc);
+static void
+print_block (tokens_type const& input, std::wostream& output,
+    document_type& doc);
+static void
+print_extref (std::wstring const& html, document_type& doc,
+    std::wostream& output);
+
+void markdown (std::wstring const& input, std::wostream& output)
+{
+    markdown (input, markdown_sink {&output});
+}
+
+void markdown (std::wstring const& input, markdown_sink const& sink)
+{
+    markdown (input, sink, markdown_options ());
+}
+
+static void
+profile_add (markdown_profile const& x, markdown_profile& total)
+{
+    total.depth = std::max (total.depth, x.depth);
+    total.fallbacks += x.fallbacks;
+    total.searched += x.searched;
+    total.delimiters += x.delimiters;
+}
+
+static void
+render_document (tokens_type const& pass1, document_type& doc)
+{
+    std::wostream nul (nullptr);
+    tokens_type pass2 (alloc_kind (doc, MDALLOC_BLOCKS));
+    markdown_sink const& sink = doc.sink;
+    std::size_t nlinks = sink.links ? sink.links->size () : 0;
+    time_point t0 = trace_start (doc, MDSTAGE_BLOCK);
+    parse_block (pass1, pass2, doc);
+    trace_end (doc, MDSTAGE_BLOCK, t0);
+    time_point t1 = trace_start (doc, MDSTAGE_PRINT);
+    bool extended = ! doc.options.inlines.empty () || doc.options.wiki.exists;
+    bool deferred = extended && (sink.html || sink.links);
+    if (! deferred)
+        print_block (pass2, sink.html ? *sink.html : nul, doc);
+    else {
+        std::wostringstream html;
+        print_block (pass2, html, doc);
+        print_extref (html.str (), doc, sink.html ? *sink.html : nul);
+    }
+    trace_end (doc, MDSTAGE_PRINT, t1);
+    if (sink.profile)
+        profile_add (doc.profile, *sink.profile);
+    if (! sink.links)
+        return;
+    for (auto& x : doc.dict)
+        if (! x.second.used)
+            sink.links->push_back ({x.second.offset, MDLINK_UNUSED, x.second.uri});
+    std::stable_sort (sink.links->begin () + nlinks, sink.links->end (),
+        [](markdown_link const& a, markdown_link const& b) {
+            return a.offset < b.offset;
+        });
+}
+
+void markdown (std::wstring const& input, markdown_sink const& sink,
+    markdown_options const& options)
+{
+    document_type doc {{}, sink, options, {}, {}, true};
+    alloc_begin (doc);
+    tokens_type pass1 (alloc_kind (doc, MDALLOC_LINES));
+    doc.origin[input.data ()] = 0;
+    MARKDOWN_PROBE (markdown__start, input.size ());
+    time_point t0 = trace_start (doc, MDSTAGE_SPLIT);
+    split_lines (input.cbegin (), input.cend (), pass1, doc);
+    trace_end (doc, MDSTAGE_SPLIT, t0);
+    render_document (pass1, doc);
+    MARKDOWN_PROBE (markdown__done, input.size ());
+}
+
+void markdown (std::deque<std::wstring> const& chunks,
+    markdown_sink const& sink, markdown_options const& options)
+{
+    rope_type rope;
+    document_type doc {{}, sink, options, {}, {}, true};
+    alloc_begin (doc);
+    tokens_type pass1 (alloc_kind (doc, MDALLOC_LINES));
+    std::ptrdiff_t size = 0;
+    for (std::wstring const& x : chunks)
+        if (! x.empty ()) {
+            rope.chunk.push_back (&x);
+            rope.offset.push_back (size);
+            doc.origin[x.data ()] = size;
+            size += x.size ();
+        }
+    rope.offset.push_back (size);
+    MARKDOWN_PROBE (markdown__start, size);
+    time_point t0 = trace_start (doc, MDSTAGE_SPLIT);
+    split_lines (rope_iterator {&rope, 0, 0}, rope_iterator {&rope, size, 0},
+        pass1, doc);
+    trace_end (doc, MDSTAGE_SPLIT, t0);
+    for (std::size_t i = 0; i < rope.carry.size (); ++i)
+        doc.origin[rope.carry[i].data ()] = rope.carryoffset[i];
+    render_document (pass1, doc);
+    MARKDOWN_PROBE (markdown__done, size);
 }
 
 static bool
 ismdescapable (int c)
 {
-    static std::wstring esc (L"\\`*_{}[]()<>#+-.!^");
+    static std::wstring esc (MARKDOWN_RUBY
+        ? L"\\`*_{}[]()<>#+-.!^" : L"\\`*_{}[]()<>#+-.!");
     return esc.find (c) != std::wstring::npos;
 }
 
@@ -218,11 +674,12 @@ ishtattr (int c)
 }
 
 /* scan /$c{n1,n2}/ from pos to eos */
-static char_iterator
-scan_of (char_iterator const pos, char_iterator const eos,
+template <typename Iter>
+static Iter
+scan_of (Iter const pos, Iter const eos,
          int const n1, int const n2, int const c)
 {
-    char_iterator p = pos;
+    Iter p = pos;
     for (int i = 0; n2 < 0 || i < n2; ++i, ++p) {
         if (p < eos && c == *p)
             continue;
@@ -234,11 +691,12 @@ scan_of (char_iterator const pos, char_iterator const eos,
     return p;
 }
 
-static char_iterator
-scan_of (char_iterator const pos, char_iterator const eos,
+template <typename Iter>
+static Iter
+scan_of (Iter const pos, Iter const eos,
          int const n1, int const n2, char_predicate predicate)
 {
-    char_iterator p = pos;
+    Iter p = pos;
     for (int i = 0; n2 < 0 || i < n2; ++i, ++p) {
         if (p < eos && predicate (*p))
             continue;
@@ -251,33 +709,36 @@ scan_of (char_iterator const pos, char_iterator const eos,
 }
 
 /* reverse scan */
-static char_iterator
-rscan_of (char_iterator const bos, char_iterator const pos, int c)
+template <typename Iter>
+static Iter
+rscan_of (Iter const bos, Iter const pos, int c)
 {
-    char_iterator p = pos;
+    Iter p = pos;
     for (; bos <= p - 1 && c == p[-1]; --p)
         ;
     return p;
 }
 
-static char_iterator
-rscan_of (char_iterator const bos, char_iterator const pos,
+template <typename Iter>
+static Iter
+rscan_of (Iter const bos, Iter const pos,
           char_predicate predicate)
 {
-    char_iterator p = pos;
+    Iter p = pos;
     for (; bos <= p - 1 && predicate (p[-1]); --p)
         ;
     return p;
 }
 
 /* scan quoted string "abc", or [abc], or (abc). may be nested and escaped */
-static char_iterator
-scan_quoted (char_iterator const pos, char_iterator const eos,
+template <typename Iter>
+static Iter
+scan_quoted (Iter const pos, Iter const eos,
              int lquote, int rquote, int escape, char_predicate predicate)
 {
     if (! (pos < eos && lquote == *pos))
         return pos;
-    char_iterator p = pos + 1;
+    Iter p = pos + 1;
     int level = 1;
     while (level > 0) {
         if (! (p < eos && predicate (*p)))
@@ -285,8 +746,10 @@ scan_quoted (char_iterator const pos, char_iterator const eos,
         if (escape == *p && p + 1 < eos
                 && (escape == p[1] || rquote == p[1] || lquote == p[1]))
             ++p;
-        else if (lquote == '(' && '<' == *p)
-            p = scan_quoted (p, eos, '<', '>', escape, predicate) - 1;
+        else if (lquote == '(' && '<' == *p) {
+            Iter q = scan_quoted (p, eos, '<', '>', escape, predicate);
+            p = p < q ? q - 1 : p;  // an unclosed < is a character
+        }
         else if (rquote == *p)
             --level;
         else if (lquote == *p)
@@ -297,8 +760,9 @@ scan_quoted (char_iterator const pos, char_iterator const eos,
 }
 
 /* decode reference style link id */
+template <typename Iter>
 static std::wstring
-decode_linkid (char_iterator s, char_iterator const eos)
+decode_linkid (Iter s, Iter const eos)
 {
     std::wstring id;
     for (; s < eos; ++s)
@@ -318,15 +782,22 @@ decode_linkid (char_iterator s, char_iterator const eos)
 }
 
 /* unescape backslash */
-static std::wstring
-unescape_backslash (char_iterator s, char_iterator const eos)
+template <typename Iter, typename String>
+static void
+unescape_backslash (Iter s, Iter const eos, String& str)
 {
-    std::wstring str;
     for (; s < eos; ++s)
         if ('\\' == *s && s + 1 < eos && ismdescapable (s[1]))
             str.push_back (*++s);
         else
             str.push_back (*s);
+}
+
+static std::wstring
+unescape_backslash (char_iterator s, char_iterator const eos)
+{
+    std::wstring str;
+    unescape_backslash (s, eos, str);
     return str;
 }
 
@@ -343,8 +814,9 @@ scan_tab (char_iterator const pos, char_iterator const eos)
 }
 
 /* not tab */
-static char_iterator
-scan_tab_not (char_iterator const pos, char_iterator const eos)
+template <typename Iter>
+static Iter
+scan_tab_not (Iter const pos, Iter const eos)
 {
     return scan_of (pos, eos, 0, 3, ' ');
 }
@@ -391,7 +863,7 @@ scan_listmark (char_iterator const pos, char_iterator const eos)
 
 static line_iterator
 parse_blank (line_iterator const dot, line_iterator const dol,
-    std::deque<token_type>& output)
+    tokens_type& output)
 {
     line_iterator line1 = dot;
     for (; line1 != dol && BLANK == line1->kind; ++line1)
@@ -401,7 +873,7 @@ parse_blank (line_iterator const dot, line_iterator const dol,
 
 static line_iterator
 parse_hrule (line_iterator const dot, line_iterator const dol,
-    std::deque<token_type>& output)
+    tokens_type& output, document_type& doc)
 {
     char_iterator p1 = scan_hrule (dot->cbegin, dot->cend);
     if (p1 == dot->cbegin)
@@ -412,7 +884,7 @@ parse_hrule (line_iterator const dot, line_iterator const dol,
 
 static line_iterator
 parse_seheading (line_iterator const dot, line_iterator const dol,
-    std::deque<token_type>& output)
+    tokens_type& output)
 {
     line_iterator line2 = dot + 1;
     if (line2 == dol)
@@ -438,7 +910,7 @@ parse_seheading (line_iterator const dot, line_iterator const dol,
 
 static line_iterator
 parse_atxheading (line_iterator const dot, line_iterator const dol,
-    std::deque<token_type>& output)
+    tokens_type& output, document_type& doc)
 {
     static const int stag[6] = {
         SHEADING1, SHEADING2, SHEADING3, SHEADING4, SHEADING5, SHEADING6};
@@ -466,7 +938,7 @@ parse_atxheading (line_iterator const dot, line_iterator const dol,
 
 static line_iterator
 parse_listitem (line_iterator const dot, line_iterator const dol,
-    std::deque<token_type>& output)
+    tokens_type& output)
 {
     char_iterator p1 = scan_tab_not (dot->cbegin, dot->cend);
     if (! (p1 < dot->cend && ismdgraph (*p1)))
@@ -484,7 +956,7 @@ parse_listitem (line_iterator const dot, line_iterator const dol,
 
 static line_iterator
 parse_paragraph (line_iterator const dot, line_iterator const dol,
-    std::deque<token_type>& output)
+    tokens_type& output)
 {
     char_iterator p1 = scan_tab_not (dot->cbegin, dot->cend);
     if (! (p1 < dot->cend && ismdgraph (*p1)))
@@ -500,7 +972,7 @@ parse_paragraph (line_iterator const dot, line_iterator const dol,
 
 static line_iterator
 parse_tabcode_line (line_iterator const dot, line_iterator const dol,
-    std::deque<token_type>& output)
+    tokens_type& output)
 {
     char_iterator p = scan_tab (dot->cbegin, dot->cend);
     if (p == dot->cbegin)
@@ -511,7 +983,7 @@ parse_tabcode_line (line_iterator const dot, line_iterator const dol,
 
 static line_iterator
 parse_tabcode_blank (line_iterator const dot, line_iterator const dol,
-    std::deque<token_type>& output)
+    tokens_type& output)
 {
     line_iterator line2 = parse_blank (dot, dol, output);
     if (! (line2 != dol && LINE == line2->kind))
@@ -526,7 +998,7 @@ parse_tabcode_blank (line_iterator const dot, line_iterator const dol,
 
 static line_iterator
 parse_tabcode (line_iterator const dot, line_iterator const dol,
-    std::deque<token_type>& output)
+    tokens_type& output, document_type& doc)
 {
     char_iterator p1 = scan_tab (dot->cbegin, dot->cend);
     if (p1 == dot->cbegin)
@@ -550,7 +1022,7 @@ parse_tabcode (line_iterator const dot, line_iterator const dol,
 
 static line_iterator
 parse_blockquote_line (line_iterator const dot, line_iterator const dol,
-    std::deque<token_type>& block, bool& lazyline)
+    tokens_type& block, bool& lazyline)
 {
     char_iterator p1 = scan_tab_not (dot->cbegin, dot->cend);
     char_iterator p2 = scan_of (p1, dot->cend, 0, 1, '>');
@@ -569,7 +1041,7 @@ parse_blockquote_line (line_iterator const dot, line_iterator const dol,
 
 static line_iterator
 parse_blockquote_blank (line_iterator const dot, line_iterator const dol,
-    std::deque<token_type>& block, bool& lazyline)
+    tokens_type& block, bool& lazyline)
 {
     line_iterator line2 = parse_blank (dot, dol, block);
     if (! (line2 != dol && LINE == line2->kind))
@@ -586,9 +1058,9 @@ parse_blockquote_blank (line_iterator const dot, line_iterator const dol,
 
 static line_iterator
 parse_blockquote (line_iterator const dot, line_iterator const dol,
-    std::deque<token_type>& output)
+    tokens_type& output, document_type& doc)
 {
-    std::deque<token_type> block;
+    tokens_type block (alloc_kind (doc, MDALLOC_BLOCKS));
     char_iterator p1 = scan_tab_not (dot->cbegin, dot->cend);
     char_iterator p2 = scan_of (p1, dot->cend, 1, 1, '>');
     if (p1 == p2)
@@ -607,13 +1079,13 @@ parse_blockquote (line_iterator const dot, line_iterator const dol,
         line1 = line2;
     }
     block.push_back ({EBLOCKQUOTE, line1->cend, line1->cend});
-    parse_block (block, output);
+    parse_block (block, output, doc);
     return line1;
 }
 
 static line_iterator
 parse_list_line (line_iterator const dot, line_iterator const dol,
-    std::deque<token_type>& block)
+    tokens_type& block)
 {
     char_iterator p1 = scan_listmark (dot->cbegin, dot->cend);
     if (p1 == dot->cbegin) {
@@ -631,7 +1103,7 @@ parse_list_line (line_iterator const dot, line_iterator const dol,
 
 static line_iterator
 parse_list_blank (line_iterator const dot, line_iterator const dol,
-    std::deque<token_type>& block)
+    tokens_type& block)
 {
     line_iterator line2 = parse_blank (dot, dol, block);
     if (! (line2 != dol && LINE == line2->kind))
@@ -651,9 +1123,9 @@ parse_list_blank (line_iterator const dot, line_iterator const dol,
 
 static line_iterator
 parse_list (line_iterator const dot, line_iterator const dol,
-    std::deque<token_type>& output)
+    tokens_type& output, document_type& doc)
 {
-    std::deque<token_type> block;
+    tokens_type block (alloc_kind (doc, MDALLOC_BLOCKS));
     char_iterator p1 = scan_listmark (dot->cbegin, dot->cend);
     if (p1 == dot->cbegin)
         return dot;
@@ -677,30 +1149,140 @@ parse_list (line_iterator const dot, line_iterator const dol,
     }
     block.push_back ({ELITEM, line1->cbegin, line1->cbegin});
     block.push_back ({etag, line1->cbegin, line1->cbegin});
-    parse_block (block, output);
+    parse_block (block, output, doc);
+    return line1;
+}
+
+/* lines from an opening line to a closing one, rendered by an extension */
+static line_iterator
+parse_extension (markdown_block_extension const& ext,
+    line_iterator const dot, line_iterator const dol,
+    tokens_type& output, document_type& doc)
+{
+    std::deque<std::wstring> lines (1, std::wstring (dot->cbegin, dot->cend));
+    if (! ext.open (lines.front ()))
+        return dot;
+    line_iterator line1 = dot + 1;
+    while (line1 != dol && (LINE == line1->kind || BLANK == line1->kind)) {
+        lines.push_back (std::wstring (line1->cbegin, line1->cend));
+        ++line1;
+        if (ext.close (lines.front (), lines.back ()))
+            break;
+    }
+    doc.blockhtml.push_back (ext.render (lines));
+    std::wstring const& html = doc.blockhtml.back ();
+    output.push_back ({HTML, html.cbegin (), html.cend ()});
     return line1;
 }
 
+/* compared unsigned, as wchar_t may be signed, and a negative character
+ * of the input must not index the table
+ */
+static std::size_t
+blocktable_slot (wchar_t c)
+{
+    auto u = static_cast<std::make_unsigned<wchar_t>::type> (c);
+    return u < 128 ? u : 0;
+}
+
+static void
+blocktable_add (blocktable_type& table, std::wstring const& leaders,
+    block_parser_type parse, markdown_block_extension const* ext)
+{
+    for (wchar_t c : leaders)
+        table.rule[blocktable_slot (c)].push_back ({parse, ext});
+}
+
+/* built-in rules in the order of tries */
+static void
+blocktable_builtin (blocktable_type& table)
+{
+    blocktable_add (table, L"*-_", parse_hrule, nullptr);
+    blocktable_add (table, L" \t", parse_tabcode, nullptr);
+    blocktable_add (table, L">", parse_blockquote, nullptr);
+    blocktable_add (table, L"#", parse_atxheading, nullptr);
+    blocktable_add (table, L"*+-0123456789", parse_list, nullptr);
+}
+
+/* extensions take precedence over the built-in rules */
+static blocktable_type const&
+document_blocktable (document_type& doc)
+{
+    static blocktable_type const builtin = [] {
+        blocktable_type table;
+        blocktable_builtin (table);
+        return table;
+    } ();
+    if (doc.options.blocks.empty ())
+        return builtin;
+    if (! doc.blocktable) {
+        doc.blocktable.reset (new blocktable_type);
+        for (auto& x : doc.options.blocks)
+            blocktable_add (*doc.blocktable, x.leaders, nullptr, &x);
+        blocktable_builtin (*doc.blocktable);
+    }
+    return *doc.blocktable;
+}
+
+static line_iterator
+parse_blockrule (blocktable_type const& table,
+    line_iterator const dot, line_iterator const dol,
+    tokens_type& output, document_type& doc)
+{
+    char_iterator p1 = scan_tab_not (dot->cbegin, dot->cend);
+    if (p1 >= dot->cend)
+        return dot;
+    for (auto& x : table.rule[blocktable_slot (*p1)]) {
+        line_iterator line1 = x.ext
+            ? parse_extension (*x.ext, dot, dol, output, doc)
+            : x.parse (dot, dol, output, doc);
+        if (line1 != dot)
+            return line1;
+    }
+    return dot;
+}
+
+/* offset in the input of the first character of tokens, for probes.
+ * tokens without characters are at 0.
+ */
+static std::size_t
+input_offset (line_iterator dot, line_iterator const dol,
+    document_type const& doc)
+{
+    while (dot < dol && dot->cbegin == dot->cend)
+        ++dot;
+    if (dot == dol)
+        return 0;
+    wchar_t const* s = &*dot->cbegin;
+    auto o = doc.origin.upper_bound (s);
+    if (o == doc.origin.cbegin ())
+        return 0;
+    --o;
+    return (s - o->first) + o->second;
+}
+
 static void
-parse_block (std::deque<token_type> const& input, std::deque<token_type>& output)
+parse_block (tokens_type const& input, tokens_type& output,
+    document_type& doc)
 {
+    blocktable_type const& table = document_blocktable (doc);
     line_iterator dot = input.cbegin ();
     line_iterator dol = input.cend ();
     bool listitem = false;
+    bool probed = MARKDOWN_PROBE_ENABLED (parse__block__start)
+        || MARKDOWN_PROBE_ENABLED (parse__block__deep)
+        || MARKDOWN_PROBE_ENABLED (parse__block__done);
+    std::size_t offset = probed ? input_offset (dot, dol, doc) : 0;
+    MARKDOWN_PROBE (parse__block__start, offset, input.size (), doc.blockdepth);
+    if (++doc.blockdepth > deepblock)
+        MARKDOWN_PROBE (parse__block__deep, offset, doc.blockdepth);
+    doc.profile.depth = std::max<std::size_t> (doc.profile.depth, doc.blockdepth);
     while (dot != dol) {
         line_iterator line = dot;
         if (SLITEM == line->kind)
             listitem = true;
         if (LINE == line->kind) {
-            if ((dot = parse_hrule (line, dol, output)) != line)
-                continue;
-            if ((dot = parse_tabcode (line, dol, output)) != line)
-                continue;
-            if ((dot = parse_blockquote (line, dol, output)) != line)
-                continue;
-            if ((dot = parse_atxheading (line, dol, output)) != line)
-                continue;
-            if ((dot = parse_list (line, dol, output)) != line)
+            if ((dot = parse_blockrule (table, line, dol, output, doc)) != line)
                 continue;
             if ((dot = parse_seheading (line, dol, output)) != line)
                 continue;
@@ -715,85 +1297,142 @@ parse_block (std::deque<token_type> const& input, std::deque<token_type>& output
             ++dot;
         }
     }
+    --doc.blockdepth;
+    MARKDOWN_PROBE (parse__block__done, offset, output.size ());
 }
 
 /* split_lines - BLOCK tokenizer */
 
-static char_iterator
-check_blockend (char_iterator const pos, char_iterator const eos)
+static token_type
+make_token (int kind, char_iterator const cbegin, char_iterator const cend)
 {
-    char_iterator p1 = scan_of (pos, eos, 0, -1, ismdspace);
-    char_iterator p2 = scan_of (p1, eos, 1, 1, '\n');
-    char_iterator p3 = scan_of (p2, eos, 0, -1, ismdspace);
-    char_iterator p4 = scan_of (p3, eos, 1, 1, '\n');
+    return {kind, cbegin, cend};
+}
+
+static token_type
+make_token (int kind, rope_iterator const cbegin, rope_iterator const cend)
+{
+    rope_type& rope = *cbegin.rope;
+    std::size_t k = std::upper_bound (rope.offset.cbegin (), rope.offset.cend (),
+        cbegin.pos) - rope.offset.cbegin () - 1;
+    if (k >= rope.chunk.size ())
+        k = rope.chunk.size () - 1;
+    if (cend.pos <= rope.offset[k + 1]) {
+        char_iterator s = rope.chunk[k]->cbegin () + (cbegin.pos - rope.offset[k]);
+        return {kind, s, s + (cend - cbegin)};
+    }
+    rope.carry.push_back (std::wstring (cbegin, cend));
+    rope.carryoffset.push_back (cbegin.pos);
+    return {kind, rope.carry.back ().cbegin (), rope.carry.back ().cend ()};
+}
+
+template <typename Iter>
+static Iter
+check_blockend (Iter const pos, Iter const eos)
+{
+    Iter p1 = scan_of (pos, eos, 0, -1, ismdspace);
+    Iter p2 = scan_of (p1, eos, 1, 1, '\n');
+    Iter p3 = scan_of (p2, eos, 0, -1, ismdspace);
+    Iter p4 = scan_of (p3, eos, 1, 1, '\n');
     return eos <= p4 || (p1 < p2 && p3 < p4) ? p2 : pos;
 }
 
-static char_iterator
-parse_blockcode (char_iterator const bos, char_iterator const pos,
-    char_iterator const eos, std::deque<token_type>& output)
+template <typename Iter>
+static Iter
+parse_blockcode (Iter const bos, Iter const pos,
+    Iter const eos, tokens_type& output, std::size_t& searched)
 {
     static const std::wstring pat (L"\n```");
     if (pos - 2 >= bos && '\n' != pos[-2])
         return pos;
     if (pos - 1 >= bos && '\n' != pos[-1])
         return pos;
-    char_iterator p1 = scan_of (pos, eos, 3, 3, '`');
+    Iter p1 = scan_of (pos, eos, 3, 3, '`');
     if (p1 == pos)
         return pos;
-    char_iterator p2 = scan_of (p1, eos, 0, -1, ismdprint);
-    char_iterator p3 = scan_of (p2, eos, 1, 1, '\n');
+    Iter p2 = scan_of (p1, eos, 0, -1, ismdprint);
+    Iter p3 = scan_of (p2, eos, 1, 1, '\n');
     if (p3 == p2)
         return pos;
-    char_iterator cbegin = p3 + 1;
-    char_iterator cend = p3 + 1;
+    Iter cbegin = p3 + 1;
+    Iter cend = p3 + 1;
     while (p3 < eos) {
-        char_iterator p4 = std::search (p3, eos, pat.cbegin (), pat.cend ());
-        if (p4 == eos)
+        Iter p4 = std::search (p3, eos, pat.cbegin (), pat.cend ());
+        searched += p4 - p3;
+        if (p4 == eos) {
+            MARKDOWN_PROBE (blockcode__unclosed, pos - bos, eos - cbegin);
             return pos;
+        }
         cend = p4;
         p3 = p4 + pat.size ();
-        char_iterator p5 = check_blockend (p3, eos);
+        Iter p5 = check_blockend (p3, eos);
         if (p5 >= eos || p3 < p5) {
-            output.push_back ({SPRE, p1, p2});
-            output.push_back ({CODE, cbegin, cend});
-            output.push_back ({EPRE, cend, cend});
+            output.push_back (make_token (SPRE, p1, p2));
+            output.push_back (make_token (CODE, cbegin, cend));
+            output.push_back (make_token (EPRE, cend, cend));
             return p5;
         }
     }
     return pos;
 }
 
-static char_iterator
-scan_htmlcomment (char_iterator const pos, char_iterator const eos,
+/* $$ display math $$ between blank lines */
+template <typename Iter>
+static Iter
+parse_blockmath (Iter const bos, Iter const pos,
+    Iter const eos, tokens_type& output)
+{
+    static const std::wstring pat (L"$$");
+    if (pos - 2 >= bos && '\n' != pos[-2])
+        return pos;
+    if (pos - 1 >= bos && '\n' != pos[-1])
+        return pos;
+    Iter p1 = scan_of (pos, eos, 2, 2, '$');
+    if (p1 == pos)
+        return pos;
+    Iter p2 = std::search (p1, eos, pat.cbegin (), pat.cend ());
+    if (p2 == eos)
+        return pos;
+    Iter p3 = p2 + pat.size ();
+    Iter p4 = check_blockend (p3, eos);
+    if (! (p4 >= eos || p3 < p4))
+        return pos;
+    output.push_back (make_token (MATHBLOCK, p1, p2));
+    return p4;
+}
+
+template <typename Iter>
+static Iter
+scan_htmlcomment (Iter const pos, Iter const eos,
     std::wstring& tagname)
 {
-    char_iterator p1 = scan_of (pos, eos, 1, 1, '<');
-    char_iterator p2 = scan_of (p1, eos, 1, 1, '!');
-    char_iterator p3 = scan_of (p2, eos, 2, 2, '-');
+    Iter p1 = scan_of (pos, eos, 1, 1, '<');
+    Iter p2 = scan_of (p1, eos, 1, 1, '!');
+    Iter p3 = scan_of (p2, eos, 2, 2, '-');
     if (! (pos < p1 && p1 < p2 && p2 < p3))
         return pos;
     tagname.assign (L"!COMMENT");
     std::wstring pat (L"-->");
-    char_iterator p4 = std::search (p3, eos, pat.cbegin (), pat.cend ());
+    Iter p4 = std::search (p3, eos, pat.cbegin (), pat.cend ());
     if (p4 == eos)
         return pos;
     return p4 + pat.size ();
 }
 
-static char_iterator
-scan_htmlattr (char_iterator const pos, char_iterator const eos)
+template <typename Iter>
+static Iter
+scan_htmlattr (Iter const pos, Iter const eos)
 {
-    char_iterator p1 = scan_of (pos, eos, 1, -1, ismdwhite);
-    char_iterator p2 = scan_of (p1, eos, 1, -1, ishtname);
+    Iter p1 = scan_of (pos, eos, 1, -1, ismdwhite);
+    Iter p2 = scan_of (p1, eos, 1, -1, ishtname);
     if (! (pos < p1 && p1 < p2))
         return pos;
-    char_iterator p3 = scan_of (p2, eos, 0, -1, ismdwhite);
-    char_iterator p4 = scan_of (p3, eos, 1, 1, '=');
+    Iter p3 = scan_of (p2, eos, 0, -1, ismdwhite);
+    Iter p4 = scan_of (p3, eos, 1, 1, '=');
     if (p4 == p3)
         return p2;
-    char_iterator p5 = scan_of (p4, eos, 0, -1, ismdwhite);
-    char_iterator p6 = p5;
+    Iter p5 = scan_of (p4, eos, 0, -1, ismdwhite);
+    Iter p6 = p5;
     if (p5 < eos && ('"' == *p5 || '\'' == *p5 || '`' == *p5))
         p6 = scan_quoted (p5, eos, *p5, *p5, -1, ismdany);
     else
@@ -803,69 +1442,72 @@ scan_htmlattr (char_iterator const pos, char_iterator const eos)
     return p6;
 }
 
-static char_iterator
-scan_htmltag (char_iterator const pos, char_iterator const eos,
+template <typename Iter>
+static Iter
+scan_htmltag (Iter const pos, Iter const eos,
     std::wstring& tagname)
 {
-    char_iterator pcom = scan_htmlcomment (pos, eos, tagname);
+    Iter pcom = scan_htmlcomment (pos, eos, tagname);
     if (pos < pcom)
         return pcom;
-    char_iterator p1 = scan_of (pos, eos, 1, 1, '<');
-    char_iterator p2 = scan_of (p1, eos, 0, 1, '/');
-    char_iterator p3 = scan_of (p2, eos, 1, -1, ishtname);
+    Iter p1 = scan_of (pos, eos, 1, 1, '<');
+    Iter p2 = scan_of (p1, eos, 0, 1, '/');
+    Iter p3 = scan_of (p2, eos, 1, -1, ishtname);
     if (! (pos < p1 && p2 < p3))
         return pos;
     tagname.assign (p1, p3);
-    char_iterator p4 = p3;
+    Iter p4 = p3;
     while (p4 < eos) {
-        char_iterator p5 = scan_htmlattr (p4, eos);
+        Iter p5 = scan_htmlattr (p4, eos);
         if (p5 == p4)
             break;
         p4 = p5;
     }
-    char_iterator p6 = scan_of (p4, eos, 0, -1, ismdwhite);
-    char_iterator p7 = scan_of (p6, eos, 0, 1, '/');
-    char_iterator p8 = scan_of (p7, eos, 1, 1, '>');
+    Iter p6 = scan_of (p4, eos, 0, -1, ismdwhite);
+    Iter p7 = scan_of (p6, eos, 0, 1, '/');
+    Iter p8 = scan_of (p7, eos, 1, 1, '>');
     if (p8 == p7)
         return pos;
     return p8;
 }
 
-static char_iterator
-parse_blockhtml (char_iterator const bos, char_iterator const pos,
-    char_iterator const eos, std::deque<token_type>& output)
+template <typename Iter>
+static Iter
+parse_blockhtml (Iter const bos, Iter const pos,
+    Iter const eos, tokens_type& output, std::size_t& searched)
 {
     if (pos - 2 >= bos && '\n' != pos[-2])
         return pos;
     if (pos - 1 >= bos && '\n' != pos[-1])
         return pos;
     std::wstring tagname;
-    char_iterator p1 = scan_htmltag (pos, eos, tagname);
+    Iter p1 = scan_htmltag (pos, eos, tagname);
     if (p1 == pos)
         return pos;
     std::wstring pat1 = std::wstring (L" ") + tagname + L" ";
     if (blocktag.find (pat1) == std::wstring::npos)
         return pos;
     if (tagname == L"hr" || tagname == L"!COMMENT" || '/' == p1[-2]) {
-        char_iterator p3 = check_blockend (p1, eos);
+        Iter p3 = check_blockend (p1, eos);
         if (p3 >= eos || p1 < p3) {
-            output.push_back ({HTML, pos, p3});
+            output.push_back (make_token (HTML, pos, p3));
             return p3;
         }
     }
     else {
         std::wstring pat2 = std::wstring (L"</") + tagname;
         while (p1 < eos) {
-            char_iterator p2 = std::search (p1, eos, pat2.cbegin (), pat2.cend ());
+            Iter p2 = std::search (p1, eos, pat2.cbegin (), pat2.cend ());
+            searched += p2 - p1;
             if (p2 == eos)
                 return pos;
-            char_iterator p3 = scan_of (p2 + pat2.size (), eos, 0, -1, ismdwhite);
+            Iter p3 = scan_of (p2 + pat2.size (), eos, 0, -1, ismdwhite);
             p1 = scan_of (p3, eos, 1, 1, '>');
             if (p1 == p3)
                 return pos;
-            char_iterator p5 = check_blockend (p1, eos);
+            Iter p5 = check_blockend (p1, eos);
             if (p5 >= eos || p1 < p5) {
-                output.push_back ({HTML, pos, p5});
+                output.push_back (make_token (HTML, pos, p5));
                 return p5;
             }
         }
@@ -873,29 +1515,31 @@ parse_blockhtml (char_iterator const bos, char_iterator const pos,
     return pos;
 }
 
-static char_iterator
-scan_refdef_id (char_iterator const pos, char_iterator const eos,
+template <typename Iter>
+static Iter
+scan_refdef_id (Iter const pos, Iter const eos,
     std::wstring& id)
 {
-    char_iterator p1 = scan_tab_not (pos, eos);
-    char_iterator p2 = scan_quoted (p1, eos, '[', ']', '\\', ismdprint);
+    Iter p1 = scan_tab_not (pos, eos);
+    Iter p2 = scan_quoted (p1, eos, '[', ']', '\\', ismdprint);
     if (p1 < p2 && ']' == p1[1])
         return pos;
-    char_iterator p3 = scan_of (p2, eos, 1, 1, ':');
-    char_iterator p4 = scan_of (p3, eos, 1, -1, ismdspace);
+    Iter p3 = scan_of (p2, eos, 1, 1, ':');
+    Iter p4 = scan_of (p3, eos, 1, -1, ismdspace);
     if (! (p1 < p2 && p2 < p3 && p3 < p4))
         return pos;
     id = decode_linkid (p1 + 1, p2 - 1);
     return p4;
 }
 
-static char_iterator
-scan_refdef_uri (char_iterator const pos, char_iterator const eos,
+template <typename Iter>
+static Iter
+scan_refdef_uri (Iter const pos, Iter const eos,
     std::wstring& uri)
 {
-    char_iterator p1 = pos;
-    char_iterator p2 = pos;
-    char_iterator p3 = scan_quoted (pos, eos, '<', '>', '\\', ismdprint);
+    Iter p1 = pos;
+    Iter p2 = pos;
+    Iter p3 = scan_quoted (pos, eos, '<', '>', '\\', ismdprint);
     if (pos < p3) {
         p1 = pos + 1;
         p2 = p3 - 1;
@@ -911,19 +1555,20 @@ scan_refdef_uri (char_iterator const pos, char_iterator const eos,
     return p3;
 }
 
-static char_iterator
-scan_refdef_title (char_iterator const pos, char_iterator const eos,
+template <typename Iter>
+static Iter
+scan_refdef_title (Iter const pos, Iter const eos,
     std::wstring& title)
 {
-    char_iterator p1 = scan_of (pos, eos, 0, -1, ismdspace);
-    char_iterator p2 = scan_of (p1, eos, 1, 1, '\n');
+    Iter p1 = scan_of (pos, eos, 0, -1, ismdspace);
+    Iter p2 = scan_of (p1, eos, 1, 1, '\n');
     if (p1 < p2)
         p2 = scan_of (p2, eos, 0, -1, ismdspace);
     if (pos < p2 && p2 < eos) {
         if ('"' == *p2 || '\'' == *p2 || '`' == *p2 || '(' == *p2) {
             int qq = '(' == *p2 ? ')' : *p2;
-            char_iterator p4 = scan_of (p2, eos, 0, -1, ismdprint);
-            char_iterator p3 = rscan_of (p2, p4, ismdspace);
+            Iter p4 = scan_of (p2, eos, 0, -1, ismdprint);
+            Iter p3 = rscan_of (p2, p4, ismdspace);
             if (p3 - p2 > 2 && qq == p3[-1]) {
                 title.assign (p2 + 1, p3 - 1);
                 return p4;
@@ -933,47 +1578,242 @@ scan_refdef_title (char_iterator const pos, char_iterator const eos,
     return pos;
 }
 
-static char_iterator
-parse_refdef (char_iterator const pos, char_iterator const eos,
-    refdict_type& dict)
+template <typename Iter>
+static Iter
+parse_refdef (Iter const bos, Iter const pos,
+    Iter const eos, refdict_type& dict)
 {
     reflink_type entry;
-    char_iterator p1 = scan_refdef_id (pos, eos, entry.id);
+    entry.offset = pos - bos;
+    entry.used = false;
+    Iter p1 = scan_refdef_id (pos, eos, entry.id);
     if (p1 == pos || '^' == entry.id[0])
         return pos;
-    char_iterator p2 = scan_refdef_uri (p1, eos, entry.uri);
+    Iter p2 = scan_refdef_uri (p1, eos, entry.uri);
     if (p2 == pos)
         return pos;
-    char_iterator p3 = scan_refdef_title (p2, eos, entry.title);
-    char_iterator p4 = scan_of (p3, eos, 0, -1, ismdspace);
-    char_iterator p5 = scan_of (p4, eos, 1, 1, '\n');
+    Iter p3 = scan_refdef_title (p2, eos, entry.title);
+    Iter p4 = scan_of (p3, eos, 0, -1, ismdspace);
+    Iter p5 = scan_of (p4, eos, 1, 1, '\n');
     if (p5 < eos && p4 == p5)
         return pos;
     dict[entry.id] = entry;
     return p5;
 }
 
+static std::string encode_utf8 (std::wstring str);
+static void print_with_escape_htmlall (char_iterator s, char_iterator const e,
+    std::wostream& output);
+
+/* relative to the directory of the including document */
+static std::string
+include_path (std::string const& base, std::string const& name)
+{
+    std::size_t slash = base.rfind ('/');
+    if (name.empty () || '/' == name[0] || std::string::npos == slash)
+        return name;
+    return base.substr (0, slash + 1) + name;
+}
+
+/* renders of a file differ by these options. the hooks are told apart
+ * only by whether they are given.
+ */
+static std::string
+include_key (std::string const& path, document_type const& doc)
+{
+    markdown_options const& options = doc.options;
+    std::string key (path);
+    key += '\0';
+    key += options.emoji ? 'e' : '-';
+    key += options.smart ? 's' : '-';
+    key += options.math ? 'm' : '-';
+    key += doc.sink.frontmatter ? 'f' : '-';
+    key += options.rewrite_uri ? 'r' : '-';
+    key += options.wiki.exists ? 'w' : '-';
+    for (auto& x : options.blocks)
+        key += encode_utf8 (L'\0' + x.leaders);
+    for (auto& x : options.inlines)
+        key += encode_utf8 (std::wstring (1, x.trigger));
+    return key;
+}
+
+/* an included file rendered with the sinks it has, or nullptr if it
+ * cannot be read or it is being included already. the render is cached
+ * only when no include in it was refused, since such a cycle is cut
+ * elsewhere for other includers.
+ */
+static includefile_type const*
+include_file (std::wstring const& name, document_type& doc)
+{
+    markdown_include const& include = doc.options.include;
+    if (! doc.includecache)
+        doc.includecache = include.cache ? include.cache
+            : markdown_make_include_cache ();
+    markdown_include_cache& cache = *doc.includecache;
+    std::string path = include_path (include.path, encode_utf8 (name));
+    if (path == include.path || cache.active.count (path)) {
+        ++cache.refused;
+        return nullptr;
+    }
+    auto i = cache.source.find (path);
+    if (i == cache.source.end ()) {
+        i = cache.source.insert ({path, {false, {}}}).first;
+        i->second.readable = include.read (path, i->second.content);
+    }
+    if (! i->second.readable)
+        return nullptr;
+    includefile_type& cached = cache.file[include_key (path, doc)];
+    if (cached.rendered)
+        return &cached;
+    markdown_options options (doc.options);
+    options.include.path = path;
+    options.include.cache = doc.includecache;
+    includefile_type file {};
+    std::wostringstream html, text;
+    markdown_frontmatter frontmatter {0, {}};
+    markdown_sink sink {&html, &text, &file.outline, &file.links,
+        doc.sink.frontmatter ? &frontmatter : nullptr, &file.stats};
+    sink.profile = doc.sink.profile;
+    bool self = cache.active.insert (include.path).second;
+    cache.active.insert (path);
+    std::size_t refused = cache.refused;
+    markdown (i->second.content, sink, options);
+    cache.active.erase (path);
+    if (self)
+        cache.active.erase (include.path);
+    file.html = html.str ();
+    file.text = text.str ();
+    if (refused != cache.refused) {
+        doc.includeonce.push_back (std::move (file));
+        return &doc.includeonce.back ();
+    }
+    file.rendered = true;
+    cached = std::move (file);
+    return &cached;
+}
+
+/* !include path, or the line as text when the file is not included */
+template <typename Iter>
+static Iter
+parse_include (Iter const bos, Iter const pos, Iter const eos,
+    tokens_type& output, document_type& doc)
+{
+    static const std::wstring pat (L"!include ");
+    if (eos - pos < static_cast<std::ptrdiff_t> (pat.size ())
+            || ! std::equal (pat.cbegin (), pat.cend (), pos))
+        return pos;
+    Iter p1 = scan_of (pos + pat.size (), eos, 0, -1, ismdspace);
+    Iter p2 = scan_of (p1, eos, 0, -1, ismdprint);
+    Iter p3 = scan_of (p2, eos, 1, 1, '\n');
+    Iter p4 = rscan_of (p1, p2, ismdspace);
+    if (p1 == p4 || (p2 == p3 && p2 < eos))
+        return pos;
+    includefile_type const* file = include_file (std::wstring (p1, p4), doc);
+    if (! file) {
+        includefile_type line {};
+        line.text.assign (pos, p2);
+        std::wostringstream html;
+        html << L"<p>";
+        print_with_escape_htmlall (line.text.cbegin (), line.text.cend (), html);
+        html << L"</p>\n";
+        line.html = html.str ();
+        line.text.push_back ('\n');
+        doc.includeonce.push_back (std::move (line));
+        file = &doc.includeonce.back ();
+    }
+    doc.included.push_back ({file, static_cast<std::size_t> (pos - bos)});
+    output.push_back ({INCLUDE, file->html.cbegin (), file->html.cend ()});
+    return p3;
+}
+
+/* ---
+ * key: value
+ *   continued value
+ * ---
+ * front matter at the beginning, closed by --- or ...
+ */
+template <typename Iter>
+static Iter
+parse_frontmatter (Iter const bos, Iter const eos,
+    markdown_frontmatter& frontmatter)
+{
+    Iter p1 = scan_of (bos, eos, 3, 3, '-');
+    Iter p2 = scan_of (p1, eos, 0, -1, ismdspace);
+    Iter p3 = scan_of (p2, eos, 1, 1, '\n');
+    if (p1 == bos || p2 == p3)
+        return bos;
+    std::deque<std::pair<std::wstring, std::wstring>> field;
+    while (p3 < eos) {
+        Iter s = p3;
+        Iter e = scan_of (s, eos, 0, -1, ismdprint);
+        Iter t = rscan_of (s, e, ismdspace);
+        p3 = scan_of (e, eos, 1, 1, '\n');
+        if (p3 == e && e < eos)     // control characters
+            return bos;
+        Iter q = scan_of (s, e, 3, 3, '-');
+        if (q == s)
+            q = scan_of (s, e, 3, 3, '.');
+        if (s < q && q == t) {
+            frontmatter.size = p3 - bos;
+            frontmatter.field.swap (field);
+            return p3;
+        }
+        Iter k = scan_of (s, t, 0, -1, ismdspace);
+        Iter c = std::find (s, t, ':');
+        if (s < k && k < t && ! field.empty ()) {
+            std::wstring& value = field.back ().second;
+            if (! value.empty ())
+                value.push_back ('\n');
+            value.append (k, t);
+        }
+        else if (s == k && s < c && c < t) {
+            Iter v = scan_of (c + 1, t, 0, -1, ismdspace);
+            field.push_back ({std::wstring (s, rscan_of (s, c, ismdspace)),
+                std::wstring (v, t)});
+        }
+    }
+    return bos;
+}
+
+template <typename Iter>
 static void
-split_lines (std::wstring const& input, std::deque<token_type>& output,
-    refdict_type& dict)
+split_lines (Iter const bos, Iter const eos, tokens_type& output,
+    document_type& doc)
 {
-    char_iterator p4 = input.cbegin ();
-    while (p4 < input.cend ()) {
-        char_iterator p1 = p4;
-        if ((p4 = parse_blockcode (input.cbegin (), p1, input.cend (), output)) > p1)
+    MARKDOWN_PROBE (split__lines__start, eos - bos);
+    Iter p4 = bos;
+    if (doc.sink.frontmatter)
+        p4 = parse_frontmatter (bos, eos, *doc.sink.frontmatter);
+    while (p4 < eos) {
+        Iter p1 = p4;
+        if (MARKDOWN_FENCES
+                && (p4 = parse_blockcode (bos, p1, eos, output,
+                    doc.profile.searched)) > p1)
+            continue;
+        if (MARKDOWN_BLOCKHTML
+                && (p4 = parse_blockhtml (bos, p1, eos, output,
+                    doc.profile.searched)) > p1)
             continue;
-        if ((p4 = parse_blockhtml (input.cbegin (), p1, input.cend (), output)) > p1)
+        if (MARKDOWN_REFDEFS
+                && (p4 = parse_refdef (bos, p1, eos, doc.dict)) > p1)
             continue;
-        if ((p4 = parse_refdef (p1, input.cend (), dict)) > p1)
+        if (doc.options.math
+                && (p4 = parse_blockmath (bos, p1, eos, output)) > p1)
             continue;
-        char_iterator p2 = scan_of (p1, input.cend (), 0, -1, ismdspace);
-        char_iterator p3 = scan_of (p2, input.cend (), 0, -1, ismdprint);
-                      p4 = scan_of (p3, input.cend (), 1, 1, '\n');
+        if (doc.options.include.read
+                && (p4 = parse_include (bos, p1, eos, output, doc)) > p1)
+            continue;
+        Iter p2 = scan_of (p1, eos, 0, -1, ismdspace);
+        Iter p3 = scan_of (p2, eos, 0, -1, ismdprint);
+        if (p3 < eos && '\n' != *p3)   // control characters
+            p3 = std::find (p3, eos, '\n');
+        p4 = scan_of (p3, eos, 1, 1, '\n');
         if (p2 == p3)
-            output.push_back ({BLANK, p3, p4});
+            output.push_back (make_token (BLANK, p3, p4));
         else
-            output.push_back ({LINE, p1, p4});
+            output.push_back (make_token (LINE, p1, p4));
     }
+    MARKDOWN_PROBE (split__lines__done, eos - bos, output.size ());
 }
 
 /* parse_inline - INLINE tokenizer and parser */
@@ -981,12 +1821,12 @@ split_lines (std::wstring const& input, std::deque<token_type>& output,
 static char_iterator
 parse_inline_loop (char_iterator const bos, char_iterator const pos,
     char_iterator const eos,
-    std::deque<token_type>& output, refdict_type const& dict,
+    tokens_type& output, document_type& doc,
     std::deque<nest_type>& nest);
 
 static char_iterator
 parse_text (char_iterator const tbegin, char_iterator const tend,
-    std::deque<token_type>& output)
+    tokens_type& output)
 {
     if (tbegin >= tend)
         return tend;
@@ -1017,7 +1857,7 @@ bool nest_exists (std::deque<nest_type>& nestlist, int n)
 static void
 patch_emphasis (char_iterator embegin, char_iterator emend,
     bool leftwhite, bool rightwhite,
-    std::deque<token_type>& output, std::deque<nest_type>& nest)
+    tokens_type& output, std::deque<nest_type>& nest)
 {
     int n1 = emend - embegin;
     int n2 = 3 - n1;
@@ -1053,7 +1893,7 @@ patch_emphasis (char_iterator embegin, char_iterator emend,
 static void
 patch_emphasis_three (char_iterator embegin, char_iterator emend,
     bool leftwhite, bool rightwhite,
-    std::deque<token_type>& output, std::deque<nest_type>& nest)
+    tokens_type& output, std::deque<nest_type>& nest)
 {
     std::size_t nnest = nest.size ();
     bool already = nest_exists (nest, 3);
@@ -1093,7 +1933,7 @@ patch_emphasis_three (char_iterator embegin, char_iterator emend,
 
 static char_iterator
 parse_space (char_iterator const pos, char_iterator const eos,
-    std::deque<token_type>& output)
+    tokens_type& output)
 {
     char_iterator p1 = scan_of (pos, eos, 1, -1, ' ');
     char_iterator p2 = scan_of (p1, eos, 1, 1, '\n');
@@ -1106,7 +1946,7 @@ parse_space (char_iterator const pos, char_iterator const eos,
 
 static char_iterator
 parse_escape (char_iterator const pos, char_iterator const eos,
-    std::deque<token_type>& output)
+    tokens_type& output)
 {
     char_iterator p1 = scan_of (pos, eos, 1, 1, '\\');
     char_iterator p2 = scan_of (p1, eos, 1, 1, ismdescapable);
@@ -1118,7 +1958,7 @@ parse_escape (char_iterator const pos, char_iterator const eos,
 
 static char_iterator
 parse_inlinecode (char_iterator const pos, char_iterator const eos,
-    std::deque<token_type>& output)
+    tokens_type& output)
 {
     char_iterator p1 = scan_of (pos, eos, 1, -1, '`');
     char_iterator p2 = scan_of (p1, eos, 0, -1, ismdwhite);
@@ -1137,7 +1977,7 @@ parse_inlinecode (char_iterator const pos, char_iterator const eos,
 static char_iterator
 parse_emphasis (char_iterator const bos, char_iterator const pos,
     char_iterator const eos,
-    std::deque<token_type>& output, std::deque<nest_type>& nest)
+    tokens_type& output, std::deque<nest_type>& nest)
 {
     char_iterator p1 = scan_of (pos, eos, 1, -1, *pos);
     int n = p1 - pos;
@@ -1172,7 +2012,7 @@ match_uri (char_iterator const p, char_iterator const e)
 
 static char_iterator
 parse_angle (char_iterator const pos, char_iterator const eos,
-    std::deque<token_type>& output)
+    tokens_type& output)
 {
     std::wstring tagname;
     char_iterator p1 = scan_htmltag (pos, eos, tagname);
@@ -1183,7 +2023,7 @@ parse_angle (char_iterator const pos, char_iterator const eos,
     char_iterator p2 = scan_quoted (pos, eos, '<', '>', '\\', ismdprint);
     if (p2 - pos > 2) {
         if (match_uri (pos + 1, p2 - 1)) {
-            output.push_back ({SABEGIN, pos, pos});
+            output.push_back ({SABEGIN, pos, p2});
             output.push_back ({URI, pos + 1, p2 - 1});
             output.push_back ({SAEND, p2, p2});
             output.push_back ({TEXT, pos + 1, p2 - 1});
@@ -1203,7 +2043,7 @@ parse_link_bracket (
     char_iterator const eos,
     char_iterator const altbegin,
     char_iterator const altend,
-    std::deque<token_type>& attribute)
+    tokens_type& attribute)
 {
     char_iterator p1 = scan_of (pos, eos, 0, -1, ismdwhite);
     char_iterator p2 = scan_quoted (p1, eos, '[', ']', '\\', ismdany);
@@ -1221,7 +2061,7 @@ static char_iterator
 parse_ruby_paren (
     char_iterator const pos,
     char_iterator const eos,
-    std::deque<token_type>& attribute)
+    tokens_type& attribute)
 {
     char_iterator p1 = scan_of (pos, eos, 1, 1, '^');
     char_iterator p3 = scan_quoted (p1, eos, '(', ')', '\\', ismdany);
@@ -1236,7 +2076,7 @@ static char_iterator
 parse_link_paren (
     char_iterator const pos,
     char_iterator const eos,
-    std::deque<token_type>& attribute)
+    tokens_type& attribute)
 {
     char_iterator p6 = scan_quoted (pos, eos, '(', ')', '\\', ismdany);
     if (pos == p6)
@@ -1272,9 +2112,9 @@ static char_iterator
 parse_make_ruby (
     char_iterator const cbegin,
     char_iterator const cend,
-    std::deque<token_type>& inner,
-    std::deque<token_type>& attribute,
-    std::deque<token_type>& output)
+    tokens_type& inner,
+    tokens_type& attribute,
+    tokens_type& output)
 {
     output.push_back ({SRUBY, cbegin, cbegin});
     output.insert (output.end (), inner.begin (), inner.end ());
@@ -1289,11 +2129,11 @@ static char_iterator
 parse_make_link (
     char_iterator const cbegin,
     char_iterator const cend,
-    std::deque<token_type>& inner,
-    std::deque<token_type>& attribute,
-    std::deque<token_type>& output)
+    tokens_type& inner,
+    tokens_type& attribute,
+    tokens_type& output)
 {
-    output.push_back ({SABEGIN, cbegin, cbegin});
+    output.push_back ({SABEGIN, cbegin, cend});
     output.insert (output.end (), attribute.begin (), attribute.end ());
     output.push_back ({SAEND, cbegin, cbegin});
     output.insert (output.end (), inner.begin (), inner.end ());
@@ -1301,16 +2141,23 @@ parse_make_link (
     return cend;
 }
 
+/* explicitid: written as [text][id] or [text][], not as shortcut [text].
+ * pos: the start of the link, where an undefined id is reported.
+ */
 static bool
-parse_fetch_reference_link (
-    refdict_type const& dict, std::deque<token_type>& attribute)
+parse_fetch_reference_link (char_iterator const pos,
+    document_type& doc, tokens_type& attribute, bool explicitid)
 {
     std::wstring linkid = decode_linkid (attribute[0].cbegin, attribute[0].cend);
-    auto i = dict.find (linkid);
-    if (i == dict.end ())
+    auto i = doc.dict.find (linkid);
+    if (i == doc.dict.end ()) {
+        if (explicitid && doc.sink.links)
+            doc.undefined[pos] = linkid;
         return false;
-    reflink_type const& rf = i->second;
-    attribute.clear ();
+    }
+    reflink_type& rf = i->second;
+    rf.used = true;
+    attribute.resize (1);   // LINKID
     attribute.push_back ({URI, rf.uri.cbegin (), rf.uri.cend ()});
     if (! rf.title.empty ())
         attribute.push_back ({TITLE, rf.title.cbegin (), rf.title.cend ()});
@@ -1322,11 +2169,11 @@ parse_inline_bracket (
     char_iterator const bos,
     char_iterator const pos,
     char_iterator const eos,
-    std::deque<token_type>& inner, refdict_type const& dict,
+    tokens_type& inner, document_type& doc,
     std::deque<nest_type>& nest, int kind)
 {
-    nest.push_back ({inner.size (), kind});
-    char_iterator p1 = parse_inline_loop (bos, pos, eos, inner, dict, nest);
+    nest.push_back ({inner.size (), kind, eos});
+    char_iterator p1 = parse_inline_loop (bos, pos, eos, inner, doc, nest);
     while (nest.back ().n != kind) {
         if (1 <= nest.back ().n && nest.back ().n <= 3)
             inner[nest.back ().pos].kind = TEXT;
@@ -1336,110 +2183,532 @@ parse_inline_bracket (
     return p1;
 }
 
+/* whether links and rubies may be in a bracket of kind, as they move
+ * its ]
+ */
+static int
+bracket_context (std::deque<nest_type>& nest, int kind)
+{
+    return (0 == kind || nest_exists (nest, 0) ? 1 : 0)
+        | (4 == kind || nest_exists (nest, 4) ? 2 : 0);
+}
+
+/* the ] of a [ scanned before in the same context stays at the same
+ * place when eos is the same, or for a ] before eos within a scan to a
+ * farther eos. inner tokens of a bracket are needed only for a link or
+ * a ruby, so a [ scanned before gets them once it is known to be one,
+ * instead of a scan of it for each enclosing bracket.
+ */
+static bool
+scanned_bracket (document_type const& doc, char_iterator const p1,
+    char_iterator const eos, int context, char_iterator& p2)
+{
+    if (doc.bracketslot.empty () || p1 < doc.bracketbos || doc.bracketeos <= p1)
+        return false;
+    std::uint32_t slot = doc.bracketslot[p1 - doc.bracketbos];
+    if (0 == slot || ! (doc.brackets[slot - 1].contexts & (1 << context)))
+        return false;
+    char_iterator end = doc.brackets[slot - 1].end[context];
+    char_iterator scaneos = doc.brackets[slot - 1].scaneos[context];
+    if (end == scaneos ? eos != scaneos : ! (end < eos && eos <= scaneos))
+        return false;
+    p2 = end;
+    return true;
+}
+
+static void
+record_bracket (document_type& doc, char_iterator const p1,
+    char_iterator const p2, char_iterator const eos, int context)
+{
+    if (p1 < doc.bracketbos || doc.bracketeos <= p1)
+        return;
+    if (doc.bracketslot.empty ())
+        doc.bracketslot.resize (doc.bracketeos - doc.bracketbos);
+    std::uint32_t& slot = doc.bracketslot[p1 - doc.bracketbos];
+    if (0 == slot) {
+        doc.brackets.push_back ({{}, {}, 0});
+        slot = doc.brackets.size ();
+    }
+    bracket_type& x = doc.brackets[slot - 1];
+    x.end[context] = p2;
+    x.scaneos[context] = eos;
+    x.contexts |= 1 << context;
+}
+
 static char_iterator
 parse_ruby (
     char_iterator const bos,
     char_iterator const pos,
     char_iterator const posrbracket,
     char_iterator const eos,
-    std::deque<token_type>& output, refdict_type const& dict,
+    tokens_type& output, document_type& doc,
     std::deque<nest_type>& nest)
 {
     char_iterator poscarret = scan_of (posrbracket, eos, 1, 1, '^');
     if (posrbracket == poscarret)
         return pos;
-    std::deque<token_type> inner;
-    std::deque<token_type> attribute;
+    tokens_type inner (alloc_kind (doc, MDALLOC_INLINES));
+    tokens_type attribute (alloc_kind (doc, MDALLOC_INLINES));
     char_iterator p1 = scan_of (pos, eos, 1, 1, '[');
     if (pos == p1)
         return pos;
-    char_iterator p2 = parse_inline_bracket (bos, p1, eos, inner, dict, nest, 4);
+    int context = bracket_context (nest, 4);
+    char_iterator p2;
+    bool scanned = scanned_bracket (doc, p1, eos, context, p2);
+    if (! scanned) {
+        p2 = parse_inline_bracket (bos, p1, eos, inner, doc, nest, 4);
+        record_bracket (doc, p1, p2, eos, context);
+    }
     char_iterator p3 = scan_of (p2, eos, 1, 1, ']');
     bool already = nest_exists (nest, 4);
     char_iterator p4 = parse_ruby_paren (p3, eos, attribute);
-    if (! already && p3 < p4)
+    if (! already && p3 < p4) {
+        if (scanned)
+            parse_inline_bracket (bos, p1, eos, inner, doc, nest, 4);
         return parse_make_ruby (pos, p4, inner, attribute, output);
+    }
     return pos;
 }
 
+/* a [ without ] up to eos leaves the link brackets around it to eos
+ * unclosed too, as they scan the same tokens after it. so they stop at
+ * once, instead of scanning the rest again for each of them.
+ */
+static char_iterator
+parse_unclosed (
+    char_iterator const pos,
+    char_iterator const p1,
+    char_iterator const eos,
+    tokens_type& output,
+    std::deque<nest_type> const& nest)
+{
+    for (auto i = nest.crbegin (); i != nest.crend (); ++i)
+        if (0 == i->n || 4 == i->n)
+            return 0 == i->n && eos == i->eos ? eos : parse_text (pos, p1, output);
+    return parse_text (pos, p1, output);
+}
+
 static char_iterator
 parse_link (
     char_iterator const bos,
     char_iterator const pos,
     char_iterator const eos,
-    std::deque<token_type>& output, refdict_type const& dict,
+    tokens_type& output, document_type& doc,
     std::deque<nest_type>& nest)
 {
-    std::deque<token_type> inner;
-    std::deque<token_type> attribute;
+    tokens_type inner (alloc_kind (doc, MDALLOC_INLINES));
+    tokens_type attribute (alloc_kind (doc, MDALLOC_INLINES));
     char_iterator p1 = scan_of (pos, eos, 1, 1, '[');
     if (pos == p1)
         return pos;
-    char_iterator p2 = parse_inline_bracket (bos, p1, eos, inner, dict, nest, 0);
-    char_iterator p3 = scan_of (p2, eos, 1, 1, ']');
     bool already = nest_exists (nest, 0);
-    if (p1 == p2 || p2 == p3)
+    int context = bracket_context (nest, 0);
+    char_iterator p2;
+    bool scanned = scanned_bracket (doc, p1, eos, context, p2);
+    if (! scanned) {
+        p2 = parse_inline_bracket (bos, p1, eos, inner, doc, nest, 0);
+        record_bracket (doc, p1, p2, eos, context);
+    }
+    char_iterator p3 = scan_of (p2, eos, 1, 1, ']');
+    if (p2 == p3)
+        return parse_unclosed (pos, p1, eos, output, nest);
+    if (p1 == p2)
         return parse_text (pos, p1, output);
-    char_iterator p4ruby = parse_ruby (bos, pos, p3, eos, output, dict, nest);
-    if (p3 < p4ruby)
-        return p4ruby;
+    if (MARKDOWN_RUBY) {
+        char_iterator p4ruby = parse_ruby (bos, pos, p3, eos, output, doc, nest);
+        if (p3 < p4ruby)
+            return p4ruby;
+    }
     char_iterator p4 = parse_link_paren (p3, eos, attribute);
-    if (! already && p3 < p4)
+    if (! already && p3 < p4) {
+        if (scanned)
+            parse_inline_bracket (bos, p1, eos, inner, doc, nest, 0);
         return parse_make_link (pos, p4, inner, attribute, output);
+    }
     char_iterator p5 = parse_link_bracket (p3, eos, p1, p2, attribute);
-    if (! already && parse_fetch_reference_link (dict, attribute))
+    bool explicitid = p3 < p5 && ']' == p5[-1];
+    if (! already
+            && parse_fetch_reference_link (pos, doc, attribute, explicitid)) {
+        if (scanned)
+            parse_inline_bracket (bos, p1, eos, inner, doc, nest, 0);
         return parse_make_link (pos, p5, inner, attribute, output);
+    }
+    MARKDOWN_PROBE (link__reparse, pos - bos, p5 - pos);
+    ++doc.profile.fallbacks;
     parse_text (pos, p1, output);           // '['
-    parse_inline_loop (bos, p1, p2, output, dict, nest);
+    parse_inline_loop (bos, p1, p2, output, doc, nest);
     return parse_text (p2, p5, output);    // ']'
 }
 
 static char_iterator
 parse_make_image (
-    char_iterator const pos,
-    std::deque<token_type>& inner,
-    std::deque<token_type>& attribute,
-    std::deque<token_type>& output)
+    char_iterator const cbegin,
+    char_iterator const cend,
+    tokens_type& inner,
+    tokens_type& attribute,
+    tokens_type& output)
 {
-    output.push_back ({IMGBEGIN, pos, pos});
+    output.push_back ({IMGBEGIN, cbegin, cend});
     output.insert (output.end (), attribute.begin (), attribute.end ());
     output.insert (output.end (), inner.begin (), inner.end ());
-    output.push_back ({IMGEND, pos, pos});
-    return pos;
+    output.push_back ({IMGEND, cend, cend});
+    return cend;
 }
 
 static char_iterator
 parse_image (
     char_iterator const pos,
     char_iterator const eos,
-    std::deque<token_type>& output, refdict_type const& dict)
+    tokens_type& output, document_type& doc)
 {
-    std::deque<token_type> inner;
-    std::deque<token_type> attribute;
+    tokens_type inner (alloc_kind (doc, MDALLOC_INLINES));
+    tokens_type attribute (alloc_kind (doc, MDALLOC_INLINES));
     char_iterator p1 = scan_of (pos, eos, 1, 1, '!');
     char_iterator p2 = scan_of (p1, eos, 1, 1, '[');
-    if (pos == p1 || p1 == p2)
+    if (pos == p1)
         return pos;
+    if (p1 == p2)
+        return parse_text (pos, p1, output);
     char_iterator p3 = scan_quoted (p1, eos, '[', ']', '\\', ismdany);
     if (p1 == p3)
         return parse_text (pos, p2, output);
     inner.push_back ({ALT, p2, p3 - 1});
     char_iterator p4 = parse_link_paren (p3, eos, attribute);
     if (p3 < p4)
-        return parse_make_image (p4, inner, attribute, output);
+        return parse_make_image (pos, p4, inner, attribute, output);
     char_iterator p5 = parse_link_bracket (p3, eos, p2, p3 - 1, attribute);
-    if (parse_fetch_reference_link (dict, attribute))
-        return parse_make_image (p5, inner, attribute, output);
+    bool explicitid = p3 < p5 && ']' == p5[-1];
+    if (parse_fetch_reference_link (pos, doc, attribute, explicitid))
+        return parse_make_image (pos, p5, inner, attribute, output);
     return parse_text (pos, p5, output);
 }
 
+/* :name: - emoji shortcodes by a precomputed perfect hash.
+ * a name maps to a bucket by emoji_hash (name, 0) % 128, and to its
+ * slot by emoji_hash (name, emojiseed[bucket]) % 512. the seeds are
+ * chosen so that no two names share a slot.
+ */
+static const struct {
+    char const* name;
+    wchar_t code;
+} emojitable[] = {
+    {"+1", 0x1F44D}, {"-1", 0x1F44E}, {"100", 0x1F4AF}, {"8ball", 0x1F3B1},
+    {"airplane", 0x2708}, {"alarm_clock", 0x23F0}, {"alien", 0x1F47D},
+    {"angel", 0x1F47C}, {"anger", 0x1F4A2}, {"angry", 0x1F620},
+    {"anguished", 0x1F627}, {"ant", 0x1F41C}, {"apple", 0x1F34E},
+    {"arrow_down", 0x2B07}, {"arrow_left", 0x2B05}, {"arrow_right", 0x27A1},
+    {"arrow_up", 0x2B06}, {"arrows_counterclockwise", 0x1F504},
+    {"art", 0x1F3A8}, {"astonished", 0x1F632}, {"baby", 0x1F476},
+    {"baby_chick", 0x1F424}, {"balloon", 0x1F388},
+    {"ballot_box_with_check", 0x2611}, {"banana", 0x1F34C},
+    {"bangbang", 0x203C}, {"bar_chart", 0x1F4CA}, {"baseball", 0x26BE},
+    {"basketball", 0x1F3C0}, {"bear", 0x1F43B}, {"bee", 0x1F41D},
+    {"beer", 0x1F37A}, {"beers", 0x1F37B}, {"beetle", 0x1F41E},
+    {"bell", 0x1F514}, {"bike", 0x1F6B2}, {"bird", 0x1F426},
+    {"birthday", 0x1F382}, {"black_heart", 0x1F5A4}, {"blue_heart", 0x1F499},
+    {"blush", 0x1F60A}, {"boar", 0x1F417}, {"book", 0x1F4D6},
+    {"bookmark", 0x1F516}, {"books", 0x1F4DA}, {"boom", 0x1F4A5},
+    {"boy", 0x1F466}, {"broken_heart", 0x1F494}, {"bug", 0x1F41B},
+    {"bulb", 0x1F4A1}, {"cactus", 0x1F335}, {"cake", 0x1F370},
+    {"calendar", 0x1F4C6}, {"camera", 0x1F4F7}, {"car", 0x1F697},
+    {"cat", 0x1F431}, {"chart_with_downwards_trend", 0x1F4C9},
+    {"chart_with_upwards_trend", 0x1F4C8}, {"checkered_flag", 0x1F3C1},
+    {"cherries", 0x1F352}, {"cherry_blossom", 0x1F338}, {"chicken", 0x1F414},
+    {"christmas_tree", 0x1F384}, {"clap", 0x1F44F}, {"clipboard", 0x1F4CB},
+    {"cloud", 0x2601}, {"clown_face", 0x1F921}, {"cocktail", 0x1F378},
+    {"coffee", 0x2615}, {"cold_sweat", 0x1F630}, {"collision", 0x1F4A5},
+    {"computer", 0x1F4BB}, {"confounded", 0x1F616}, {"confused", 0x1F615},
+    {"construction", 0x1F6A7}, {"cookie", 0x1F36A}, {"cool", 0x1F192},
+    {"cop", 0x1F46E}, {"corn", 0x1F33D}, {"cow", 0x1F42E},
+    {"crescent_moon", 0x1F319}, {"cry", 0x1F622}, {"cupid", 0x1F498},
+    {"cyclone", 0x1F300}, {"dancer", 0x1F483}, {"dart", 0x1F3AF},
+    {"dash", 0x1F4A8}, {"date", 0x1F4C5}, {"deciduous_tree", 0x1F333},
+    {"disappointed", 0x1F61E}, {"disappointed_relieved", 0x1F625},
+    {"dizzy", 0x1F4AB}, {"dizzy_face", 0x1F635}, {"dog", 0x1F436},
+    {"dollar", 0x1F4B5}, {"dolphin", 0x1F42C}, {"doughnut", 0x1F369},
+    {"droplet", 0x1F4A7}, {"e-mail", 0x1F4E7}, {"ear", 0x1F442},
+    {"earth_africa", 0x1F30D}, {"earth_americas", 0x1F30E},
+    {"earth_asia", 0x1F30F}, {"eggplant", 0x1F346}, {"elephant", 0x1F418},
+    {"email", 0x2709}, {"envelope", 0x2709}, {"evergreen_tree", 0x1F332},
+    {"exclamation", 0x2757}, {"expressionless", 0x1F611}, {"eyes", 0x1F440},
+    {"facepunch", 0x1F44A}, {"fallen_leaf", 0x1F342}, {"fearful", 0x1F628},
+    {"fire", 0x1F525}, {"fish", 0x1F41F}, {"fist", 0x270A},
+    {"flushed", 0x1F633}, {"foggy", 0x1F301}, {"football", 0x1F3C8},
+    {"four_leaf_clover", 0x1F340}, {"free", 0x1F193}, {"fries", 0x1F35F},
+    {"frog", 0x1F438}, {"frowning", 0x1F626}, {"full_moon", 0x1F315},
+    {"gear", 0x2699}, {"gem", 0x1F48E}, {"ghost", 0x1F47B}, {"gift", 0x1F381},
+    {"girl", 0x1F467}, {"globe_with_meridians", 0x1F310}, {"grapes", 0x1F347},
+    {"green_apple", 0x1F34F}, {"green_heart", 0x1F49A},
+    {"grey_exclamation", 0x2755}, {"grey_question", 0x2754},
+    {"grimacing", 0x1F62C}, {"grin", 0x1F601}, {"grinning", 0x1F600},
+    {"guitar", 0x1F3B8}, {"hamburger", 0x1F354}, {"hammer", 0x1F528},
+    {"hamster", 0x1F439}, {"hand", 0x270B}, {"hankey", 0x1F4A9},
+    {"headphones", 0x1F3A7}, {"hear_no_evil", 0x1F649}, {"heart", 0x2764},
+    {"heart_eyes", 0x1F60D}, {"heart_eyes_cat", 0x1F63B},
+    {"heartbeat", 0x1F493}, {"heartpulse", 0x1F497},
+    {"heavy_check_mark", 0x2714}, {"heavy_division_sign", 0x2797},
+    {"heavy_exclamation_mark", 0x2757}, {"heavy_minus_sign", 0x2796},
+    {"heavy_multiplication_x", 0x2716}, {"heavy_plus_sign", 0x2795},
+    {"honeybee", 0x1F41D}, {"horse", 0x1F434}, {"hospital", 0x1F3E5},
+    {"hourglass", 0x231B}, {"house", 0x1F3E0}, {"hugs", 0x1F917},
+    {"hushed", 0x1F62F}, {"icecream", 0x1F366}, {"imp", 0x1F47F},
+    {"information_source", 0x2139}, {"innocent", 0x1F607},
+    {"interrobang", 0x2049}, {"iphone", 0x1F4F1}, {"jack_o_lantern", 0x1F383},
+    {"joy", 0x1F602}, {"joy_cat", 0x1F639}, {"key", 0x1F511},
+    {"kiss", 0x1F48B}, {"kissing", 0x1F617}, {"kissing_closed_eyes", 0x1F61A},
+    {"kissing_heart", 0x1F618}, {"kissing_smiling_eyes", 0x1F619},
+    {"koala", 0x1F428}, {"laughing", 0x1F606}, {"lemon", 0x1F34B},
+    {"link", 0x1F517}, {"lips", 0x1F444}, {"lock", 0x1F512},
+    {"loudspeaker", 0x1F4E2}, {"mag", 0x1F50D}, {"man", 0x1F468},
+    {"maple_leaf", 0x1F341}, {"mask", 0x1F637}, {"mega", 0x1F4E3},
+    {"melon", 0x1F348}, {"memo", 0x1F4DD}, {"metal", 0x1F918},
+    {"microphone", 0x1F3A4}, {"moneybag", 0x1F4B0}, {"monkey", 0x1F412},
+    {"monkey_face", 0x1F435}, {"mouse", 0x1F42D}, {"movie_camera", 0x1F3A5},
+    {"muscle", 0x1F4AA}, {"mushroom", 0x1F344}, {"musical_note", 0x1F3B5},
+    {"nerd_face", 0x1F913}, {"neutral_face", 0x1F610}, {"new", 0x1F195},
+    {"new_moon", 0x1F311}, {"no_entry", 0x26D4}, {"no_mouth", 0x1F636},
+    {"nose", 0x1F443}, {"notes", 0x1F3B6}, {"o", 0x2B55}, {"ocean", 0x1F30A},
+    {"octopus", 0x1F419}, {"office", 0x1F3E2}, {"ok", 0x1F197},
+    {"ok_hand", 0x1F44C}, {"older_man", 0x1F474}, {"older_woman", 0x1F475},
+    {"open_book", 0x1F4D6}, {"open_hands", 0x1F450}, {"open_mouth", 0x1F62E},
+    {"package", 0x1F4E6}, {"palm_tree", 0x1F334}, {"panda_face", 0x1F43C},
+    {"paperclip", 0x1F4CE}, {"peach", 0x1F351}, {"pear", 0x1F350},
+    {"pencil", 0x1F4DD}, {"pencil2", 0x270F}, {"penguin", 0x1F427},
+    {"pensive", 0x1F614}, {"persevere", 0x1F623}, {"phone", 0x260E},
+    {"pig", 0x1F437}, {"pineapple", 0x1F34D}, {"pizza", 0x1F355},
+    {"point_down", 0x1F447}, {"point_left", 0x1F448},
+    {"point_right", 0x1F449}, {"point_up", 0x261D}, {"point_up_2", 0x1F446},
+    {"poop", 0x1F4A9}, {"pray", 0x1F64F}, {"punch", 0x1F44A},
+    {"purple_heart", 0x1F49C}, {"pushpin", 0x1F4CC}, {"question", 0x2753},
+    {"rabbit", 0x1F430}, {"radio", 0x1F4FB}, {"rage", 0x1F621},
+    {"rainbow", 0x1F308}, {"raised_hand", 0x270B}, {"raised_hands", 0x1F64C},
+    {"recycle", 0x267B}, {"red_car", 0x1F697}, {"relaxed", 0x263A},
+    {"relieved", 0x1F60C}, {"revolving_hearts", 0x1F49E}, {"ring", 0x1F48D},
+    {"robot", 0x1F916}, {"rocket", 0x1F680}, {"rofl", 0x1F923},
+    {"roll_eyes", 0x1F644}, {"rose", 0x1F339}, {"rotating_light", 0x1F6A8},
+    {"runner", 0x1F3C3}, {"running", 0x1F3C3}, {"santa", 0x1F385},
+    {"satisfied", 0x1F606}, {"school", 0x1F3EB}, {"scissors", 0x2702},
+    {"scream", 0x1F631}, {"see_no_evil", 0x1F648}, {"seedling", 0x1F331},
+    {"sheep", 0x1F411}, {"ship", 0x1F6A2}, {"shit", 0x1F4A9},
+    {"skull", 0x1F480}, {"sleeping", 0x1F634}, {"sleepy", 0x1F62A},
+    {"slightly_smiling_face", 0x1F642}, {"smile", 0x1F604},
+    {"smile_cat", 0x1F638}, {"smiley", 0x1F603}, {"smiley_cat", 0x1F63A},
+    {"smirk", 0x1F60F}, {"snail", 0x1F40C}, {"snake", 0x1F40D},
+    {"snowflake", 0x2744}, {"snowman", 0x26C4}, {"sob", 0x1F62D},
+    {"soccer", 0x26BD}, {"soon", 0x1F51C}, {"sos", 0x1F198},
+    {"sparkles", 0x2728}, {"sparkling_heart", 0x1F496},
+    {"speak_no_evil", 0x1F64A}, {"star", 0x2B50}, {"star2", 0x1F31F},
+    {"strawberry", 0x1F353}, {"stuck_out_tongue", 0x1F61B},
+    {"stuck_out_tongue_closed_eyes", 0x1F61D},
+    {"stuck_out_tongue_winking_eye", 0x1F61C}, {"sun_with_face", 0x1F31E},
+    {"sunflower", 0x1F33B}, {"sunglasses", 0x1F60E}, {"sunny", 0x2600},
+    {"sweat", 0x1F613}, {"sweat_drops", 0x1F4A6}, {"sweat_smile", 0x1F605},
+    {"tada", 0x1F389}, {"tangerine", 0x1F34A}, {"tea", 0x1F375},
+    {"telephone", 0x260E}, {"tennis", 0x1F3BE}, {"thinking", 0x1F914},
+    {"thumbsdown", 0x1F44E}, {"thumbsup", 0x1F44D}, {"tiger", 0x1F42F},
+    {"tired_face", 0x1F62B}, {"tomato", 0x1F345}, {"tongue", 0x1F445},
+    {"triangular_flag_on_post", 0x1F6A9}, {"triumph", 0x1F624},
+    {"trophy", 0x1F3C6}, {"tropical_fish", 0x1F420}, {"tulip", 0x1F337},
+    {"turtle", 0x1F422}, {"tv", 0x1F4FA}, {"two_hearts", 0x1F495},
+    {"umbrella", 0x2614}, {"unamused", 0x1F612}, {"unlock", 0x1F513},
+    {"up", 0x1F199}, {"upside_down_face", 0x1F643}, {"v", 0x270C},
+    {"video_game", 0x1F3AE}, {"walking", 0x1F6B6}, {"warning", 0x26A0},
+    {"watch", 0x231A}, {"watermelon", 0x1F349}, {"wave", 0x1F44B},
+    {"weary", 0x1F629}, {"whale", 0x1F433}, {"white_check_mark", 0x2705},
+    {"wine_glass", 0x1F377}, {"wink", 0x1F609}, {"wolf", 0x1F43A},
+    {"woman", 0x1F469}, {"worried", 0x1F61F}, {"wrench", 0x1F527},
+    {"x", 0x274C}, {"yellow_heart", 0x1F49B}, {"yum", 0x1F60B},
+    {"zap", 0x26A1}, {"zipper_mouth_face", 0x1F910}, {"zzz", 0x1F4A4},
+};
+
+/* bucket of emoji_hash (name, 0) to the seed of its slots */
+static const unsigned char emojiseed[128] = {
+    4, 2, 2, 1, 7, 0, 2, 2, 1, 2, 2, 2, 1, 0, 5, 1,
+    4, 1, 2, 0, 3, 0, 9, 1, 3, 9, 1, 0, 1, 2, 3, 3,
+    1, 4, 7, 1, 14, 4, 3, 4, 3, 1, 7, 3, 1, 8, 2, 5,
+    11, 1, 8, 2, 5, 2, 2, 7, 2, 2, 8, 4, 2, 3, 4, 2,
+    3, 3, 4, 4, 3, 4, 11, 4, 1, 6, 3, 7, 9, 5, 2, 15,
+    1, 5, 13, 5, 1, 2, 3, 17, 0, 1, 2, 2, 4, 0, 14, 2,
+    2, 11, 3, 1, 1, 6, 14, 5, 2, 2, 5, 13, 5, 1, 25, 1,
+    3, 1, 1, 7, 14, 1, 4, 1, 14, 7, 2, 3, 5, 5, 8, 13,
+};
+
+/* slot of emoji_hash (name, seed) to index + 1 of emojitable */
+static const unsigned short emojislot[512] = {
+    196, 95, 272, 7, 332, 343, 32, 360, 149, 320, 0, 0, 31, 271, 0, 163,
+    190, 0, 5, 0, 193, 0, 182, 109, 275, 169, 181, 351, 71, 0, 0, 336,
+    119, 0, 279, 334, 331, 0, 49, 0, 302, 0, 37, 78, 15, 0, 141, 0,
+    111, 0, 359, 0, 344, 0, 0, 0, 125, 82, 180, 0, 110, 0, 0, 94,
+    2, 29, 0, 173, 0, 86, 358, 175, 48, 75, 77, 315, 224, 0, 0, 249,
+    55, 216, 43, 0, 284, 338, 171, 156, 0, 0, 265, 0, 202, 61, 348, 0,
+    0, 0, 208, 325, 140, 0, 0, 352, 128, 356, 189, 293, 350, 253, 0, 234,
+    0, 166, 0, 290, 206, 69, 98, 84, 223, 76, 278, 185, 0, 0, 242, 327,
+    0, 46, 0, 0, 245, 0, 0, 210, 0, 0, 64, 276, 0, 291, 124, 235,
+    294, 191, 93, 136, 282, 162, 10, 305, 342, 0, 283, 148, 152, 0, 243, 176,
+    42, 0, 218, 21, 114, 0, 306, 33, 115, 0, 177, 72, 312, 137, 45, 0,
+    299, 63, 0, 106, 232, 60, 254, 251, 194, 179, 0, 0, 121, 345, 313, 12,
+    0, 240, 65, 259, 0, 0, 0, 3, 155, 0, 316, 0, 135, 147, 186, 195,
+    150, 0, 167, 129, 230, 0, 14, 221, 138, 6, 79, 143, 307, 154, 0, 0,
+    26, 47, 126, 252, 220, 0, 225, 296, 335, 0, 321, 80, 0, 263, 289, 1,
+    349, 40, 112, 297, 0, 100, 108, 273, 0, 89, 0, 0, 22, 70, 0, 0,
+    51, 280, 347, 0, 0, 248, 287, 159, 0, 0, 0, 214, 0, 103, 187, 0,
+    228, 222, 0, 62, 67, 0, 319, 324, 285, 257, 0, 118, 99, 153, 0, 0,
+    11, 188, 59, 0, 17, 145, 144, 0, 54, 337, 354, 309, 90, 318, 30, 244,
+    0, 0, 97, 0, 247, 326, 68, 0, 127, 330, 0, 107, 261, 34, 35, 0,
+    295, 134, 130, 105, 0, 0, 0, 0, 183, 0, 36, 4, 9, 18, 139, 203,
+    0, 255, 92, 0, 0, 286, 258, 311, 87, 0, 0, 197, 50, 201, 341, 81,
+    101, 164, 39, 170, 16, 122, 120, 264, 288, 281, 274, 157, 0, 0, 0, 200,
+    357, 277, 0, 0, 353, 38, 66, 231, 0, 56, 298, 310, 19, 0, 209, 0,
+    52, 0, 262, 192, 267, 0, 116, 0, 211, 304, 0, 0, 133, 0, 0, 57,
+    317, 314, 0, 0, 172, 151, 322, 165, 237, 346, 117, 74, 292, 13, 27, 340,
+    178, 158, 0, 241, 28, 25, 0, 239, 0, 8, 0, 23, 0, 355, 329, 0,
+    303, 24, 268, 160, 44, 0, 83, 0, 0, 0, 146, 0, 204, 199, 0, 91,
+    88, 0, 0, 102, 0, 85, 0, 0, 53, 226, 205, 113, 0, 0, 58, 0,
+    219, 0, 20, 323, 0, 207, 238, 184, 308, 0, 266, 300, 229, 0, 131, 0,
+    233, 104, 215, 213, 260, 0, 333, 227, 41, 250, 73, 161, 301, 168, 174, 339,
+    0, 142, 198, 0, 217, 212, 132, 123, 246, 0, 328, 270, 236, 269, 96, 256,
+};
+
+static unsigned long
+emoji_hash (char_iterator s, char_iterator const e, unsigned long seed)
+{
+    unsigned long h = 2166136261UL ^ seed;
+    for (; s < e; ++s)
+        h = ((h ^ static_cast<unsigned long> (*s)) * 16777619UL) & 0xffffffffUL;
+    return h;
+}
+
+/* code point of a name, or 0 */
+static wchar_t
+emoji_lookup (char_iterator s, char_iterator const e)
+{
+    unsigned long seed = emojiseed[emoji_hash (s, e, 0) % 128];
+    std::size_t k = emojislot[emoji_hash (s, e, seed) % 512];
+    if (0 == seed || 0 == k)
+        return 0;
+    char const* name = emojitable[k - 1].name;
+    for (; s < e && *name && *s == *name; ++s, ++name)
+        ;
+    return s == e && ! *name ? emojitable[k - 1].code : 0;
+}
+
+static bool
+isemojiname (int c)
+{
+    return ('a' <= c && c <= 'z') || ('0' <= c && c <= '9')
+        || '_' == c || '+' == c || '-' == c;
+}
+
+static char_iterator
+parse_emoji (char_iterator const pos, char_iterator const eos,
+    tokens_type& output)
+{
+    char_iterator p1 = pos + 1;
+    char_iterator p2 = scan_of (p1, eos, 0, -1, isemojiname);
+    char_iterator p3 = scan_of (p2, eos, 1, 1, ':');
+    if (p1 == p2 || p2 == p3 || ! emoji_lookup (p1, p2))
+        return parse_text (pos, p1, output);
+    output.push_back ({EMOJI, pos, p3});
+    return p3;
+}
+
+/* index of unescaped dollars that may close math spans. a closing $
+ * follows a non-white character and precedes no digit.
+ */
+static void
+scan_math_dollar (char_iterator const bos, char_iterator const eos,
+    std::vector<std::size_t> (&dollar)[2])
+{
+    dollar[0].clear ();
+    dollar[1].clear ();
+    for (char_iterator s = bos; s < eos; ++s)
+        if ('\\' == *s)
+            ++s;
+        else if ('$' == *s) {
+            if (s > bos && ! ismdwhite (s[-1])
+                    && ! (s + 1 < eos && ismddigit (s[1])))
+                dollar[0].push_back (s - bos);
+            if (s + 1 < eos && '$' == s[1])
+                dollar[1].push_back (s - bos);
+        }
+}
+
+/* $tex$ and $$tex$$ - math spans closed by the next $ or $$ of the
+ * index, so that their contents are not parsed.
+ */
+static char_iterator
+parse_math (char_iterator const bos, char_iterator const pos,
+    char_iterator const eos,
+    tokens_type& output, document_type& doc)
+{
+    std::size_t n = pos + 1 < eos && '$' == pos[1] ? 2 : 1;
+    char_iterator p1 = pos + n;
+    if (p1 >= eos || ismdwhite (*p1))
+        return parse_text (pos, p1, output);
+    std::vector<std::size_t> const& dollar = doc.dollar[n - 1];
+    auto k = std::lower_bound (dollar.cbegin (), dollar.cend (),
+        (p1 - bos) + (2 - n));
+    if (k == dollar.cend () || *k + n > std::size_t (eos - bos))
+        return parse_text (pos, p1, output);
+    char_iterator p2 = bos + *k;
+    output.push_back ({2 == n ? DMATH : MATH, p1, p2});
+    return p2 + n;
+}
+
+static markdown_inline_extension const*
+find_inline_extension (document_type& doc, int c)
+{
+    for (auto& x : doc.options.inlines)
+        if (c == x.trigger)
+            return &x;
+    return nullptr;
+}
+
+/* @name - a trigger of an inline extension, and a name */
+static char_iterator
+parse_extref (char_iterator const bos, char_iterator const pos,
+    char_iterator const eos,
+    tokens_type& output, document_type& doc,
+    std::deque<nest_type>& nest)
+{
+    markdown_inline_extension const* ext = find_inline_extension (doc, *pos);
+    char_iterator p1 = pos + 1;
+    if ((pos > bos && ext->isname (pos[-1])) || nest_exists (nest, 0))
+        return parse_text (pos, p1, output);
+    char_iterator p2 = p1;
+    while (p2 < eos && ext->isname (*p2))
+        ++p2;
+    if (p1 == p2)
+        return parse_text (pos, p1, output);
+    output.push_back ({EXTREF, pos, p2});
+    return p2;
+}
+
+/* [[page]] or [[page|label]] */
+static char_iterator
+parse_wikilink (char_iterator const pos, char_iterator const eos,
+    tokens_type& output, std::deque<nest_type>& nest)
+{
+    char_iterator p1 = scan_of (pos, eos, 2, 2, '[');
+    if (p1 == pos || nest_exists (nest, 0))
+        return pos;
+    char_iterator p2 = p1;
+    while (p2 < eos && ']' != *p2 && '[' != *p2 && '\n' != *p2)
+        ++p2;
+    char_iterator p3 = scan_of (p2, eos, 2, 2, ']');
+    if (p1 == p2 || p2 == p3)
+        return pos;
+    output.push_back ({WIKILINK, p1, p2});
+    return p3;
+}
+
 static char_iterator
 parse_inline_loop (
     char_iterator const bos,
     char_iterator const pos,
     char_iterator const eos,
-    std::deque<token_type>& output,
-    refdict_type const& dict,
+    tokens_type& output,
+    document_type& doc,
     std::deque<nest_type>& nest)
 {
     char_iterator p1 = pos;
@@ -1450,16 +2719,27 @@ parse_inline_loop (
             p1 = parse_escape (p1, eos, output);
         else if ('`' == *p1)
             p1 = parse_inlinecode (p1, eos, output);
-        else if ('*' == *p1 || '_' == *p1)
+        else if ('*' == *p1 || '_' == *p1) {
+            ++doc.profile.delimiters;
             p1 = parse_emphasis (bos, p1, eos, output, nest);
+        }
         else if ('<' == *p1)
             p1 = parse_angle (p1, eos, output);
-        else if ('[' == *p1)
-            p1 = parse_link (bos, p1, eos, output, dict, nest);
+        else if ('[' == *p1) {
+            char_iterator p2 = doc.options.wiki.exists
+                ? parse_wikilink (p1, eos, output, nest) : p1;
+            p1 = p1 < p2 ? p2 : parse_link (bos, p1, eos, output, doc, nest);
+        }
         else if ('!' == *p1)
-            p1 = parse_image (p1, eos, output, dict);
+            p1 = parse_image (p1, eos, output, doc);
+        else if ('$' == *p1 && doc.options.math)
+            p1 = parse_math (bos, p1, eos, output, doc);
+        else if (':' == *p1 && doc.options.emoji)
+            p1 = parse_emoji (p1, eos, output);
+        else if (doc.triggers.find (*p1) != std::wstring::npos)
+            p1 = parse_extref (bos, p1, eos, output, doc, nest);
         else {
-            static std::wstring ccls (L" \\`*_<![]");
+            std::wstring const& ccls = doc.ccls;
             char_iterator p2
                 = std::find_first_of (p1, eos, ccls.cbegin (), ccls.cend ());
             p1 = parse_text (p1, p2, output);
@@ -1469,16 +2749,31 @@ parse_inline_loop (
 }
 
 static void
-parse_inline (std::wstring const& input, std::deque<token_type>& output,
-    refdict_type const& dict)
+parse_inline (std::wstring const& input, tokens_type& output,
+    document_type& doc)
 {
     std::deque<nest_type> nest;
     char_iterator const bos = input.cbegin ();
     char_iterator const eos = input.cend ();
+    if (doc.ccls.empty ()) {
+        for (auto& x : doc.options.inlines)
+            doc.triggers.push_back (x.trigger);
+        doc.ccls = L" \\`*_<![]" + doc.triggers;
+        if (doc.options.emoji)
+            doc.ccls.push_back (':');
+        if (doc.options.math)
+            doc.ccls.push_back ('$');
+    }
+    if (doc.options.math)
+        scan_math_dollar (bos, eos, doc.dollar);
+    doc.bracketbos = bos;
+    doc.bracketeos = eos;
+    doc.bracketslot.clear ();
+    doc.brackets.clear ();
     char_iterator pos = bos;
     while (pos < eos) {
         char_iterator pos0 = pos;
-        pos = parse_inline_loop (bos, pos0, eos, output, dict, nest);
+        pos = parse_inline_loop (bos, pos0, eos, output, doc, nest);
         if (pos0 == pos && ']' == *pos)
             pos = parse_text (pos, pos + 1, output);
     }
@@ -1491,8 +2786,9 @@ parse_inline (std::wstring const& input, std::deque<token_type>& output,
 
 /* print_inline - INLINE output builder */
 
+template <typename Iter>
 static bool
-check_html5entity (char_iterator& s0, char_iterator const e)
+check_html5entity (Iter& s0, Iter const e)
 {
     static int tbl[7][6] = {
     //      d   x   a   #   ;
@@ -1506,7 +2802,7 @@ check_html5entity (char_iterator& s0, char_iterator const e)
     };
     if (! (s0 < e && '&' == *s0))
         return false;
-    char_iterator s = s0 + 1;
+    Iter s = s0 + 1;
     int state = 1;
     for (; s < e; ++s) {
         int ccls = ('0' <= *s && *s <= '9') ? 1
@@ -1524,43 +2820,71 @@ check_html5entity (char_iterator& s0, char_iterator const e)
     return false;
 }
 
-static std::wstring
-decode_utf8 (std::string octets)
+/* made once, as naming a locale reads its files */
+static std::codecvt<wchar_t, char, std::mbstate_t> const&
+utf8_codecvt ()
+{
+    static std::locale const loc (std::locale::classic (), "C.UTF-8",
+        std::locale::ctype);
+    return std::use_facet<std::codecvt<wchar_t, char, std::mbstate_t>> (loc);
+}
+
+template <typename String, typename WString>
+static void
+decode_utf8 (String const& octets, WString& str)
 {
-    std::locale loc (std::locale::classic (), "C.UTF-8", std::locale::ctype);
-    auto& cvt = std::use_facet<std::codecvt<wchar_t, char, std::mbstate_t>> (loc);
+    auto& cvt = utf8_codecvt ();
     auto mb = std::mbstate_t ();
-    std::wstring str (octets.size (), L'\0');
+    str.assign (octets.size (), L'\0');
     char const* octetsnext;
     wchar_t* strnext;
     cvt.in (mb, &octets[0], &octets[octets.size ()], octetsnext,
                 &str[0], &str[str.size ()], strnext);
     str.resize (strnext - &str[0]);
-    return str;
 }
 
-static std::string
-encode_utf8 (std::wstring str)
+template <typename WString, typename String>
+static void
+encode_utf8 (WString const& str, String& octets)
 {
-    std::locale loc (std::locale::classic (), "C.UTF-8", std::locale::ctype);
-    auto& cvt = std::use_facet<std::codecvt<wchar_t, char, std::mbstate_t>> (loc);
+    auto& cvt = utf8_codecvt ();
     auto mb = std::mbstate_t ();
-    std::string octets(str.size () * cvt.max_length (), '\0');
+    octets.assign (str.size () * cvt.max_length (), '\0');
     wchar_t const* strnext;
     char* octetsnext;
     cvt.out (mb, &str[0], &str[str.size ()], strnext,
                  &octets[0], &octets[octets.size ()], octetsnext);
     octets.resize (octetsnext - &octets[0]);
+}
+
+static std::string
+encode_utf8 (std::wstring str)
+{
+    std::string octets;
+    encode_utf8 (str, octets);
     return octets;
 }
 
+/* smart quotes open after these */
+static bool
+ismdquoteopen (int c)
+{
+    return 0 == c || ismdwhite (c)
+        || '(' == c || '[' == c || '{' == c || '-' == c;
+}
+
+/* with smart, quotes, dashes and ellipses become typographic ones,
+ * and *smart keeps the previous character for pairing quotes. a single
+ * quote before a digit is an apostrophe, as in '90s.
+ */
+template <typename Iter>
 static void
-print_with_escape_html (char_iterator s, char_iterator const e,
-    std::wostream& output)
+print_with_escape_html (Iter s, Iter const e,
+    std::wostream& output, wchar_t* smart = nullptr)
 {
-    for (; s < e; ++s)
+    for (; s < e; ++s) {
         if ('&' == *s) {
-            char_iterator s1 = s;
+            Iter s1 = s;
             if (check_html5entity (s1, e)) {
                 for (; s < s1; ++s)
                     output.put (*s);
@@ -1573,9 +2897,36 @@ print_with_escape_html (char_iterator s, char_iterator const e,
         default: output << *s; break;
         case '<': output << L"&lt;"; break;
         case '>': output << L"&gt;"; break;
-        case '"': output << L"&quot;"; break;
-        case '\'': output << L"&#39;"; break;
+        case '"':
+            output << (! smart ? L"&quot;"
+                : ismdquoteopen (*smart) ? L"&#8220;" : L"&#8221;");
+            break;
+        case '\'':
+            output << (! smart ? L"&#39;"
+                : ismdquoteopen (*smart) && ! (s + 1 < e && ismddigit (s[1]))
+                ? L"&#8216;" : L"&#8217;");
+            break;
+        case '-':
+            if (smart && s + 1 < e && '-' == s[1]) {
+                bool em = s + 2 < e && '-' == s[2];
+                output << (em ? L"&#8212;" : L"&#8211;");
+                s += em ? 2 : 1;
+            }
+            else
+                output << *s;
+            break;
+        case '.':
+            if (smart && s + 2 < e && '.' == s[1] && '.' == s[2]) {
+                output << L"&#8230;";
+                s += 2;
+            }
+            else
+                output << *s;
+            break;
         }
+        if (smart)
+            *smart = *s;
+    }
 }
 
 static void
@@ -1593,16 +2944,18 @@ print_with_escape_htmlall (char_iterator s, char_iterator const e,
         }
 }
 
+/* count: of the temporaries for markdown_sink::memory, or nullptr */
 static void
 print_with_escape_uri (char_iterator s, char_iterator const e,
-    std::wostream& output)
+    std::wostream& output, alloccount_type const* count = nullptr)
 {
     static const std::string safe ("-_.,:;*+=()/~?#");
     static const std::string amp ("&amp;");
-    std::wstring w (s, e);
-    std::string o = encode_utf8 (w);
-    std::string t;
-    for (std::string::const_iterator s = o.begin (); s != o.end (); ++s) {
+    tempwstring_type w (s, e, count);
+    tempstring_type o (count);
+    encode_utf8 (w, o);
+    tempstring_type t (count);
+    for (tempstring_type::const_iterator s = o.begin (); s != o.end (); ++s) {
         int c = static_cast<unsigned char> (*s);
         if (ismdalnum (c) || safe.find (c) != std::string::npos)
             t.append (1, c);        // [0-9A-Za-z\-_.,:;*+=()/~?\#]
@@ -1621,21 +2974,187 @@ print_with_escape_uri (char_iterator s, char_iterator const e,
             t.append (1, lo < 10 ? lo + '0' : lo + 'A' - 10);
         }
     }
-    output << decode_utf8 (t);
+    tempwstring_type u (count);
+    decode_utf8 (t, u);
+    output << u;
+}
+
+/* holes of markdown_compile are private use characters U+E000.. */
+static bool
+ismdhole (int c)
+{
+    return 0xe000 <= c && c < 0xf900;
+}
+
+template <typename Iter>
+static void
+print_hole_kind (Iter s, Iter const e, int kind, document_type& doc)
+{
+    if (doc.holes)
+        for (; s < e; ++s)
+            if (ismdhole (*s))
+                doc.holes->push_back ({*s, kind});
+}
+
+/* attributes of raw html with uri values */
+static bool
+ishtmluriattr (std::wstring const& name)
+{
+    return L"href" == name || L"src" == name || L"action" == name
+        || L"formaction" == name || L"cite" == name || L"poster" == name;
+}
+
+/* kinds of holes in raw html by a scan of its tags: uri in quoted values
+ * of uri attributes, attribute in other quoted values, and text outside
+ * of tags. holes in tag and attribute names, in unquoted values, and in
+ * event handlers and styles have no safe escaping.
+ */
+template <typename Iter>
+static void
+print_hole_html (Iter s, Iter const e, document_type& doc)
+{
+    enum { INTEXT, INTAG, INVALUE, UNQUOTED, QUOTED } state = INTEXT;
+    std::wstring name, attr;
+    wchar_t quote = 0;
+    if (! doc.holes)
+        return;
+    for (; s < e; ++s) {
+        wchar_t c = *s;
+        if (ismdhole (c)) {
+            int kind = INTEXT == state ? MDHOLE_TEXT
+                : QUOTED != state ? MDHOLE_NONE
+                : ishtmluriattr (attr) ? MDHOLE_URI
+                : L"style" == attr || 0 == attr.compare (0, 2, L"on")
+                ? MDHOLE_NONE : MDHOLE_ATTRIBUTE;
+            doc.holes->push_back ({c, kind});
+            if (INTAG == state)
+                name.push_back (c);
+            else if (INVALUE == state)
+                state = UNQUOTED;
+        }
+        else if (INTEXT == state) {
+            if ('<' == c) {
+                state = INTAG;
+                name.clear ();
+                attr.clear ();
+            }
+        }
+        else if (QUOTED == state) {
+            if (quote == c)
+                state = INTAG;
+        }
+        else if ('>' == c)
+            state = INTEXT;
+        else if (UNQUOTED == state) {
+            if (ismdwhite (c))
+                state = INTAG;
+        }
+        else if (INVALUE == state) {
+            if ('"' == c || '\'' == c) {
+                quote = c;
+                state = QUOTED;
+            }
+            else if (! ismdwhite (c))
+                state = UNQUOTED;
+        }
+        else if ('=' == c) {
+            if (! name.empty ())
+                attr = name;
+            name.clear ();
+            state = INVALUE;
+        }
+        else if (ismdwhite (c) || '/' == c) {
+            if (! name.empty ())
+                attr = name;
+            name.clear ();
+        }
+        else
+            name.push_back (std::towlower (c));
+    }
+}
+
+/* keep holes out of percent encoding */
+static void
+print_uri (std::wstring const& uri, std::wostream& output, document_type& doc)
+{
+    char_iterator s = uri.cbegin ();
+    if (doc.holes) {
+        char_iterator e;
+        while ((e = std::find_if (s, uri.cend (), ismdhole)) < uri.cend ()) {
+            print_with_escape_uri (s, e, output,
+                alloc_kind (doc, MDALLOC_STRINGS));
+            output << *e;
+            doc.holes->push_back ({*e, MDHOLE_URI});
+            s = e + 1;
+        }
+    }
+    print_with_escape_uri (s, uri.cend (), output,
+        alloc_kind (doc, MDALLOC_STRINGS));
+}
+
+/* map a position in the joined INLINE lines back to the input */
+static std::size_t
+source_offset (char_iterator const pos, document_type const& doc)
+{
+    std::size_t n = pos - doc.srcbegin;
+    auto i = std::upper_bound (doc.segment.cbegin (), doc.segment.cend (), n,
+        [](std::size_t n, std::pair<std::size_t, char_iterator> const& x) {
+            return n < x.first;
+        });
+    --i;
+    wchar_t const* s = &*i->second;
+    auto o = doc.origin.upper_bound (s);
+    --o;
+    return (s - o->first) + o->second + (n - i->first);
+}
+
+/* reference links share the uri of their definition, so that
+ * they also share its memo entry.
+ */
+static std::wstring const&
+rewrite_uri (std::wstring const& uri, bool image, document_type& doc)
+{
+    std::map<std::wstring, std::wstring>& memo = doc.rewritten[image];
+    auto i = memo.find (uri);
+    if (i == memo.end ())
+        i = memo.insert ({uri, doc.options.rewrite_uri (uri, image)}).first;
+    return i->second;
+}
+
+/* code spans, images and the like pair quotes after them as texts */
+static void
+smart_after (char_iterator const s, char_iterator const e, document_type& doc)
+{
+    if (s < e)
+        doc.smartprev = e[-1];
 }
 
 static token_iterator
-print_innerlink (token_iterator p, std::wostream& output, refdict_type const& dict)
+print_innerlink (token_iterator p, std::wostream& output,
+    document_type& doc, std::wstring* plain)
 {
     static const std::wstring stremtpy (L"");
     int skind = p->kind;    // SABEGIN || IMGBEGIN
+    char_iterator const linkbegin = p->cbegin;
     output << kindname[skind];
     ++p;
+    bool reference = LINKID == p->kind;
+    if (reference)
+        ++p;
     char_iterator titleb = stremtpy.cbegin ();
     char_iterator titlee = stremtpy.cend ();
     if (URI == p->kind) {
         std::wstring uri = unescape_backslash (p->cbegin, p->cend);
-        print_with_escape_uri (uri.cbegin(), uri.cend (), output);
+        if (doc.options.rewrite_uri)
+            uri = rewrite_uri (uri, IMGBEGIN == skind, doc);
+        print_uri (uri, output, doc);
+        if (doc.sink.links) {
+            int kind = IMGBEGIN == skind ? reference ? MDLINK_IMAGEREF : MDLINK_IMAGE
+                     : reference ? MDLINK_ANCHORREF
+                     : '<' == *linkbegin ? MDLINK_AUTOLINK : MDLINK_ANCHOR;
+            doc.sink.links->push_back (
+                {source_offset (linkbegin, doc), kind, uri});
+        }
         ++p;
         if (TITLE == p->kind) {
             titleb = p->cbegin;
@@ -1646,97 +3165,619 @@ print_innerlink (token_iterator p, std::wostream& output, refdict_type const& di
     if (IMGBEGIN == skind) {
         output << kindname[p->kind];    // ALT
         std::wstring alt = unescape_backslash (p->cbegin, p->cend);
+        print_hole_kind (alt.cbegin (), alt.cend (), MDHOLE_ATTRIBUTE, doc);
         print_with_escape_html (alt.cbegin(), alt.cend (), output);
+        if (plain)
+            plain->append (alt);
+        smart_after (alt.cbegin (), alt.cend (), doc);
         ++p;
     }
     if (titleb < titlee) {
         output << kindname[TITLE];
         std::wstring title = unescape_backslash (titleb, titlee);
+        print_hole_kind (title.cbegin (), title.cend (), MDHOLE_ATTRIBUTE, doc);
         print_with_escape_html (title.cbegin(), title.cend (), output);
     }
     output << kindname[p->kind];  // EAEND || IMGEND
     return p;
 }
 
+/* &#x1F604; */
+static void
+print_charref (wchar_t c, std::wostream& output)
+{
+    static const wchar_t xdigit[] = L"0123456789ABCDEF";
+    wchar_t buf[8];
+    wchar_t* s = buf + 8;
+    unsigned long x = c;
+    do
+        *--s = xdigit[x & 15];
+    while (x >>= 4);
+    output << L"&#x";
+    output.write (s, buf + 8 - s);
+    output << L';';
+}
+
+/* han and kana are counted by characters, others by words */
+static bool
+ismdcjk (int c)
+{
+    return (0x3040 <= c && c <= 0x30ff) || (0x3400 <= c && c <= 0x4dbf)
+        || (0x4e00 <= c && c <= 0x9fff) || (0xf900 <= c && c <= 0xfaff)
+        || (0x20000 <= c && c <= 0x2ffff);
+}
+
+static bool
+ismdcjkspace (int c)
+{
+    return (0x3000 <= c && c <= 0x303f) || (0xff00 <= c && c <= 0xff0f);
+}
+
+template <typename String>
+static void
+count_words (String const& text, document_type& doc)
+{
+    markdown_stats& stats = *doc.sink.stats;
+    for (wchar_t c : text)
+        if (ismdcjk (c)) {
+            ++stats.cjk;
+            doc.statsword = false;
+        }
+        else if (std::iswspace (c) || ismdcjkspace (c))
+            doc.statsword = false;
+        else if (! doc.statsword && std::iswalnum (c)) {
+            ++stats.words;
+            doc.statsword = true;
+        }
+}
+
+/* plain: if not null, appends the text content without markups */
 static void
-print_inline (std::deque<token_type>const & input, std::wostream& output,
-    refdict_type const& dict)
+print_inline (tokens_type const& input, std::wostream& output,
+    document_type& doc, std::wstring* plain)
 {
     for (token_iterator p = input.cbegin (); p < input.cend (); ++p) {
-        if (BREAK <= p->kind)
+        if (BREAK <= p->kind) {
             output << kindname[p->kind];
-        else if (CODE == p->kind)
+            if (BREAK == p->kind)
+                doc.smartprev = '\n';
+            if (plain && BREAK == p->kind)
+                plain->push_back ('\n');
+            else if (plain && (SRT == p->kind || ERT == p->kind))
+                plain->push_back (SRT == p->kind ? '(' : ')');
+        }
+        else if (CODE == p->kind) {
+            print_hole_kind (p->cbegin, p->cend, MDHOLE_TEXT, doc);
             print_with_escape_htmlall (p->cbegin, p->cend, output);
-        else if (HTML == p->kind)
+            if (plain)
+                plain->append (p->cbegin, p->cend);
+            smart_after (p->cbegin, p->cend, doc);
+        }
+        else if (HTML == p->kind) {
+            print_hole_html (p->cbegin, p->cend, doc);
             for (char_iterator i = p->cbegin; i < p->cend; ++i)
                 output << *i;
-        else if (SABEGIN == p->kind || IMGBEGIN == p->kind)
-            p = print_innerlink (p, output, dict);
+        }
+        else if (SABEGIN == p->kind || IMGBEGIN == p->kind) {
+            if (doc.sink.stats)
+                ++(SABEGIN == p->kind
+                    ? doc.sink.stats->links : doc.sink.stats->images);
+            p = print_innerlink (p, output, doc, plain);
+        }
         else if (TEXT == p->kind) {
-            std::wstring src;
+            tempwstring_type src (alloc_kind (doc, MDALLOC_STRINGS));
             for (; p < input.cend () && TEXT == p->kind; ++p)
                 if (p->cbegin < p->cend)
                     src.append (p->cbegin, p->cend);
-            std::wstring text = unescape_backslash (src.cbegin(), src.cend ());
-            print_with_escape_html (text.cbegin (), text.cend (), output);
+            tempwstring_type text (alloc_kind (doc, MDALLOC_STRINGS));
+            unescape_backslash (src.cbegin (), src.cend (), text);
+            print_hole_kind (text.cbegin (), text.cend (), MDHOLE_TEXT, doc);
+            print_with_escape_html (text.cbegin (), text.cend (), output,
+                doc.options.smart ? &doc.smartprev : nullptr);
+            if (plain)
+                plain->append (text.cbegin (), text.cend ());
+            if (doc.sink.stats)
+                count_words (text, doc);
             --p;
         }
+        else if (MATH == p->kind || DMATH == p->kind) {
+            output << (MATH == p->kind ? L"<span class=\"math inline\">"
+                : L"<span class=\"math display\">");
+            print_hole_kind (p->cbegin, p->cend, MDHOLE_TEXT, doc);
+            print_with_escape_htmlall (p->cbegin, p->cend, output);
+            output << L"</span>";
+            if (plain)
+                plain->append (p->cbegin, p->cend);
+            smart_after (p->cbegin, p->cend, doc);
+        }
+        else if (EMOJI == p->kind) {
+            wchar_t c = emoji_lookup (p->cbegin + 1, p->cend - 1);
+            print_charref (c, output);
+            if (plain)
+                plain->push_back (c);
+            doc.smartprev = c;
+        }
+        else if (EXTREF == p->kind) {
+            std::wstring name (p->cbegin, p->cend);
+            doc.extref.push_back ({output.tellp (), EXTREF, name, name,
+                doc.sink.links ? source_offset (p->cbegin, doc) : 0});
+            if (plain)
+                plain->append (name);
+            smart_after (name.cbegin (), name.cend (), doc);
+        }
+        else if (WIKILINK == p->kind) {
+            char_iterator bar = std::find (p->cbegin, p->cend, '|');
+            char_iterator s = scan_of (p->cbegin, bar, 0, -1, ismdwhite);
+            std::wstring page (s, rscan_of (s, bar, ismdwhite));
+            char_iterator t = bar < p->cend ? bar + 1 : bar;
+            t = scan_of (t, p->cend, 0, -1, ismdwhite);
+            std::wstring label = bar < p->cend
+                ? std::wstring (t, rscan_of (t, p->cend, ismdwhite)) : page;
+            doc.extref.push_back ({output.tellp (), WIKILINK, page, label,
+                doc.sink.links ? source_offset (p->cbegin - 2, doc) : 0});
+            if (doc.sink.stats)
+                ++doc.sink.stats->links;
+            if (plain)
+                plain->append (label);
+            smart_after (label.cbegin (), label.cend (), doc);
+        }
+    }
+}
+
+/* <a class="wiki missing" href="page">label</a> */
+static void
+print_wikilink (extref_type const& x, bool exists, document_type& doc,
+    std::wostream& output)
+{
+    std::wstring uri = doc.options.wiki.uri ? doc.options.wiki.uri (x.name)
+        : x.name;
+    if (doc.options.rewrite_uri)
+        uri = rewrite_uri (uri, false, doc);
+    if (doc.sink.links)
+        doc.sink.links->push_back ({x.source, MDLINK_WIKI, uri});
+    output << (exists ? L"<a class=\"wiki\" href=\""
+        : L"<a class=\"wiki missing\" href=\"");
+    print_with_escape_uri (uri.cbegin (), uri.cend (), output,
+        alloc_kind (doc, MDALLOC_STRINGS));
+    output << kindname[SAEND];
+    print_with_escape_htmlall (x.label.cbegin (), x.label.cend (), output);
+    output << kindname[EA];
+}
+
+/* resolves the names of each inline extension, and the wiki pages, in
+ * a single call for each, and prints the html with links spliced at
+ * the offsets of the names.
+ */
+static void
+print_extref (std::wstring const& html, document_type& doc,
+    std::wostream& output)
+{
+    std::map<std::wstring, std::wstring> uri;   // with the trigger
+    for (auto& ext : doc.options.inlines) {
+        std::deque<std::wstring> names;
+        for (auto& x : doc.extref)
+            if (EXTREF == x.kind && ext.trigger == x.name[0]
+                    && uri.insert ({x.name, std::wstring ()}).second)
+                names.push_back (x.name.substr (1));
+        if (names.empty ())
+            continue;
+        std::deque<std::wstring> resolved = ext.resolve (names);
+        for (std::size_t i = 0; i < names.size () && i < resolved.size (); ++i)
+            uri[ext.trigger + names[i]] = resolved[i];
+    }
+    std::map<std::wstring, bool> exists;
+    std::deque<std::wstring> pages;
+    for (auto& x : doc.extref)
+        if (WIKILINK == x.kind && exists.insert ({x.name, false}).second)
+            pages.push_back (x.name);
+    if (! pages.empty ()) {
+        std::deque<bool> found = doc.options.wiki.exists (pages);
+        for (std::size_t i = 0; i < pages.size () && i < found.size (); ++i)
+            exists[pages[i]] = found[i];
+    }
+    std::size_t pos = 0;
+    for (auto& x : doc.extref) {
+        std::size_t at = x.offset;
+        output.write (html.data () + pos, at - pos);
+        pos = at;
+        if (WIKILINK == x.kind) {
+            print_wikilink (x, exists[x.name], doc, output);
+            continue;
+        }
+        std::wstring const& u = uri[x.name];
+        if (! u.empty ()) {
+            std::wstring const& u2 = doc.options.rewrite_uri
+                ? rewrite_uri (u, false, doc) : u;
+            if (doc.sink.links)
+                doc.sink.links->push_back ({x.source, MDLINK_EXTENSION, u2});
+            output << kindname[SABEGIN];
+            print_with_escape_uri (u2.cbegin (), u2.cend (), output,
+                alloc_kind (doc, MDALLOC_STRINGS));
+            output << kindname[SAEND];
+        }
+        print_with_escape_htmlall (x.name.cbegin (), x.name.cend (), output);
+        if (! u.empty ())
+            output << kindname[EA];
     }
+    output.write (html.data () + pos, html.size () - pos);
+    doc.extref.clear ();
 }
 
 /* print_block - BLOCK output builder */
 
 static void
-print_block (std::deque<token_type> const& input,
-    std::wostream& output,
-    refdict_type const& dict)
+print_text_eol (document_type& doc)
+{
+    if (! doc.textbol)
+        *doc.sink.text << L'\n';
+    doc.textbol = true;
+}
+
+static void
+print_text (std::wstring const& plain, document_type& doc)
+{
+    if (plain.empty ())
+        return;
+    *doc.sink.text << plain;
+    doc.textbol = '\n' == plain.back ();
+}
+
+/* outputs of an included file for the sinks, with its links at the
+ * offset of the !include line
+ */
+static void
+print_included (std::pair<includefile_type const*, std::size_t> const& x,
+    document_type& doc)
+{
+    includefile_type const& file = *x.first;
+    markdown_sink const& sink = doc.sink;
+    if (sink.text) {
+        print_text_eol (doc);
+        print_text (file.text, doc);
+    }
+    if (sink.outline)
+        sink.outline->insert (sink.outline->end (),
+            file.outline.cbegin (), file.outline.cend ());
+    if (sink.links)
+        for (auto& link : file.links)
+            sink.links->push_back ({x.second, link.kind, link.uri});
+    if (sink.stats) {
+        markdown_stats& stats = *sink.stats;
+        stats.words += file.stats.words;
+        stats.cjk += file.stats.cjk;
+        stats.headings += file.stats.headings;
+        stats.links += file.stats.links;
+        stats.images += file.stats.images;
+        stats.codeblocks += file.stats.codeblocks;
+        stats.codelines += file.stats.codelines;
+    }
+}
+
+static bool
+isleafend (int kind)
+{
+    return EPRE == kind || EPARAGRAPH == kind || ELITEM == kind
+        || (EHEADING1 <= kind && kind <= EHEADING6 && EHEADING1 % 2 == kind % 2);
+}
+
+/* print a group of tokens from dot, and returns the next position */
+static line_iterator
+print_block_step (tokens_type const& input, line_iterator dot,
+    std::wostream& output, document_type& doc)
 {
-    std::deque<token_type> doc;
-    line_iterator dot = input.cbegin ();
     line_iterator dol = input.cend ();
-    for (; dot < dol && BLANK == dot->kind; ++dot)
-        ;
-    while (dot < dol) {
-        line_iterator olddot = dot;
-        if (BLANK == dot->kind) {
-            for (; dot < dol && BLANK == dot->kind; ++dot)
-                ;
-            if (dot < dol)
+    line_iterator olddot = dot;
+    if (BLANK == dot->kind) {
+        for (; dot < dol && BLANK == dot->kind; ++dot)
+            ;
+        if (dot < dol)
+            output << L"\n";
+        if (dot < dol && doc.sink.text) {
+            print_text_eol (doc);
+            *doc.sink.text << L'\n';
+        }
+    }
+    else if (HRULE <= dot->kind) {
+        if (SOLIST == dot->kind || SULIST == dot->kind) {
+            if (dot - 1 > input.cbegin () && dot[-1].kind == INLINE)
                 output << L"\n";
         }
-        else if (HRULE <= dot->kind) {
-            if (SOLIST == dot->kind || SULIST == dot->kind) {
-                if (dot - 1 > input.cbegin () && dot[-1].kind == INLINE)
-                    output << L"\n";
-            }
-            output << kindname[dot->kind];
-            ++dot;
+        if (SHEADING1 <= dot->kind && dot->kind <= EHEADING6)
+            doc.heading = SHEADING1 % 2 == dot->kind % 2
+                    ? (dot->kind - SHEADING1) / 2 + 1 : 0;
+        if (doc.sink.stats && doc.heading && SHEADING1 <= dot->kind
+                && dot->kind <= EHEADING6 && SHEADING1 % 2 == dot->kind % 2)
+            ++doc.sink.stats->headings;
+        if (doc.sink.text && (isleafend (dot->kind)
+                || SOLIST == dot->kind || SULIST == dot->kind))
+            print_text_eol (doc);
+        output << kindname[dot->kind];
+        ++dot;
+    }
+    else if (HTML == dot->kind || INCLUDE == dot->kind) {
+        print_hole_html (dot->cbegin, dot->cend, doc);
+        for (char_iterator p = dot->cbegin; p < dot->cend; ++p)
+            output << *p;
+        if (INCLUDE == dot->kind)
+            print_included (doc.included[doc.includenext++], doc);
+        ++dot;
+    }
+    else if (MATHBLOCK == dot->kind) {
+        output << L"<div class=\"math display\">";
+        print_hole_kind (dot->cbegin, dot->cend, MDHOLE_TEXT, doc);
+        print_with_escape_htmlall (dot->cbegin, dot->cend, output);
+        output << L"</div>\n";
+        if (doc.sink.text) {
+            print_text_eol (doc);
+            print_text (std::wstring (dot->cbegin, dot->cend), doc);
         }
-        else if (HTML == dot->kind) {
-            for (char_iterator p = dot->cbegin; p < dot->cend; ++p)
-                output << *p;
-            ++dot;
+        ++dot;
+    }
+    else if (CODE == dot->kind) {
+        if (doc.sink.stats) {
+            markdown_stats& stats = *doc.sink.stats;
+            line_iterator line = dot;
+            for (; line < dol && CODE == line->kind; ++line)
+                stats.codelines += std::count (line->cbegin, line->cend, '\n');
+            if (line[-1].cbegin < line[-1].cend && '\n' != line[-1].cend[-1])
+                ++stats.codelines;
+            ++stats.codeblocks;
+        }
+        for (; dot < dol && CODE == dot->kind; ++dot) {
+            char_iterator e = dot->cend;
+            if (dot + 1 < dol && CODE != dot[1].kind
+                    && dot->cbegin < dot->cend - 1 && '\n' == dot->cend[-1])
+                --e;
+            print_hole_kind (dot->cbegin, e, MDHOLE_TEXT, doc);
+            print_with_escape_htmlall (dot->cbegin, e, output);
+            if (doc.sink.text)
+                print_text (std::wstring (dot->cbegin, e), doc);
         }
-        else if (CODE == dot->kind) {
-            for (; dot < dol && CODE == dot->kind; ++dot) {
-                if (dot + 1 < dol && CODE != dot[1].kind
-                        && dot->cbegin < dot->cend - 1 && '\n' == dot->cend[-1])
-                    print_with_escape_htmlall (dot->cbegin, dot->cend - 1, output);
-                else
-                    print_with_escape_htmlall (dot->cbegin, dot->cend, output);
+    }
+    else if (INLINE == dot->kind) {
+        std::wstring src;
+        doc.segment.clear ();
+        line_iterator const first = dot;
+        for (; dot < dol && INLINE == dot->kind; ++dot) {
+            if (doc.sink.links)
+                doc.segment.push_back ({src.size (), dot->cbegin});
+            src.append (dot->cbegin, dot->cend);
+        }
+        if (src.size () > 0 && '\n' == src.back ())
+            src.pop_back ();
+        doc.srcbegin = src.cbegin ();
+        doc.smartprev = 0;
+        doc.statsword = false;
+        tokens_type inline_input (alloc_kind (doc, MDALLOC_INLINES));
+        std::wstring plain;
+        bool needplain = doc.sink.text || (doc.heading && doc.sink.outline);
+        bool probed = MARKDOWN_PROBE_ENABLED (parse__inline__start)
+            || MARKDOWN_PROBE_ENABLED (parse__inline__done);
+        std::size_t offset = probed ? input_offset (first, dot, doc) : 0;
+        MARKDOWN_PROBE (parse__inline__start, offset, src.size ());
+        time_point t0 = trace_start (doc, MDSTAGE_INLINE);
+        parse_inline (src, inline_input, doc);
+        trace_end (doc, MDSTAGE_INLINE, t0);
+        MARKDOWN_PROBE (parse__inline__done, offset, inline_input.size ());
+        print_inline (inline_input, output, doc, needplain ? &plain : nullptr);
+        for (auto& x : doc.undefined)
+            doc.sink.links->push_back (
+                {source_offset (x.first, doc), MDLINK_UNDEFINED, x.second});
+        doc.undefined.clear ();
+        if (doc.heading && doc.sink.outline)
+            doc.sink.outline->push_back ({doc.heading, plain});
+        if (doc.sink.text)
+            print_text (plain, doc);
+    }
+    if (olddot == dot)
+        ++dot;
+    return dot;
+}
+
+static line_iterator
+print_block_begin (tokens_type const& input)
+{
+    line_iterator dot = input.cbegin ();
+    for (; dot < input.cend () && BLANK == dot->kind; ++dot)
+        ;
+    return dot;
+}
+
+static void
+print_block (tokens_type const& input,
+    std::wostream& output,
+    document_type& doc)
+{
+    line_iterator dot = print_block_begin (input);
+    while (dot < input.cend ())
+        dot = print_block_step (input, dot, output, doc);
+}
+
+std::shared_ptr<markdown_include_cache>
+markdown_make_include_cache ()
+{
+    return std::make_shared<markdown_include_cache> ();
+}
+
+double
+markdown_reading_minutes (markdown_stats const& stats)
+{
+    return stats.words / 200.0 + stats.cjk / 500.0;
+}
+
+/* markdown_reader - pull api */
+
+struct markdown_reader::state_type {
+    markdown_options const options;
+    std::wostringstream html;
+    markdown_sink const sink;
+    document_type doc;
+    tokens_type pass1;
+    tokens_type pass2;
+    line_iterator dot;
+    std::wstring pending;
+    std::size_t done;
+
+    state_type (std::wstring const& input, markdown_options const& options,
+        markdown_memory* memory)
+        : options (options),
+          sink {&html, nullptr, nullptr, nullptr, nullptr, nullptr, memory},
+          doc {{}, sink, this->options, {}, {}, true},
+          pass1 (alloc_begin_kind (doc, MDALLOC_LINES)),
+          pass2 (alloc_kind (doc, MDALLOC_BLOCKS)), done (0)
+    {
+        doc.origin[input.data ()] = 0;
+        time_point t0 = trace_start (doc, MDSTAGE_SPLIT);
+        split_lines (input.cbegin (), input.cend (), pass1, doc);
+        trace_end (doc, MDSTAGE_SPLIT, t0);
+        time_point t1 = trace_start (doc, MDSTAGE_BLOCK);
+        parse_block (pass1, pass2, doc);
+        trace_end (doc, MDSTAGE_BLOCK, t1);
+        dot = print_block_begin (pass2);
+    }
+};
+
+markdown_reader::markdown_reader (std::wstring const& input,
+    markdown_options const& options, markdown_memory* memory)
+    : state (new state_type (input, options, memory))
+{
+}
+
+markdown_reader::~markdown_reader ()
+{
+}
+
+std::size_t
+markdown_reader::read (wchar_t* buf, std::size_t size)
+{
+    state_type& s = *state;
+    std::size_t n = 0;
+    while (n < size) {
+        if (s.done < s.pending.size ()) {
+            std::size_t m = std::min (size - n, s.pending.size () - s.done);
+            std::copy (s.pending.cbegin () + s.done,
+                s.pending.cbegin () + s.done + m, buf + n);
+            s.done += m;
+            n += m;
+        }
+        else if (s.dot < s.pass2.cend ()) {
+            time_point t0 = trace_start (s.doc, MDSTAGE_PRINT);
+            s.html.str (std::wstring ());
+            s.dot = print_block_step (s.pass2, s.dot, s.html, s.doc);
+            s.pending = s.html.str ();
+            if (! s.doc.extref.empty ()) {
+                std::wostringstream spliced;
+                print_extref (s.pending, s.doc, spliced);
+                s.pending = spliced.str ();
             }
+            trace_end (s.doc, MDSTAGE_PRINT, t0);
+            s.done = 0;
         }
-        else if (INLINE == dot->kind) {
-            std::wstring src;
-            for (; dot < dol && INLINE == dot->kind; ++dot)
-                src.append (dot->cbegin, dot->cend);
-            if (src.size () > 0 && '\n' == src.back ())
-                src.pop_back ();
-            std::deque<token_type> inline_input;
-            parse_inline (src, inline_input, dict);
-            print_inline (inline_input, output, dict);
+        else
+            break;
+    }
+    return n;
+}
+
+/* markdown_compile - parse once, render many templates */
+
+static bool
+isholename (int c)
+{
+    return ismdalnum (c) || '_' == c || '.' == c || '-' == c;
+}
+
+/* scan {{name}} */
+static char_iterator
+scan_placeholder (char_iterator const pos, char_iterator const eos,
+    std::wstring& name)
+{
+    char_iterator p1 = scan_of (pos, eos, 2, 2, '{');
+    char_iterator p2 = scan_of (p1, eos, 0, -1, ' ');
+    char_iterator p3 = scan_of (p2, eos, 1, -1, isholename);
+    char_iterator p4 = scan_of (p3, eos, 0, -1, ' ');
+    char_iterator p5 = scan_of (p4, eos, 2, 2, '}');
+    if (! (pos < p1 && p2 < p3 && p4 < p5))
+        return pos;
+    name.assign (p2, p3);
+    return p5;
+}
+
+bool markdown_compile (std::wstring const& input, markdown_template& tmpl)
+{
+    std::wstring src;
+    std::deque<std::wstring> names;
+    std::map<std::wstring, int> index;
+    for (char_iterator s = input.cbegin (); s < input.cend ();) {
+        std::wstring name;
+        char_iterator p1 = scan_placeholder (s, input.cend (), name);
+        if (ismdhole (*s))
+            return false;
+        else if (p1 == s)
+            src.push_back (*s++);
+        else {
+            auto i = index.insert ({name, names.size ()}).first;
+            if (i->second == static_cast<int> (names.size ()))
+                names.push_back (name);
+            if (0xe000 + i->second >= 0xf900)
+                return false;
+            src.push_back (0xe000 + i->second);
+            s = p1;
         }
-        if (olddot == dot)
-            ++dot;
     }
+    std::wostringstream html;
+    std::deque<std::pair<wchar_t, int>> holes;
+    markdown_sink sink {&html};
+    markdown_options options;
+    tokens_type pass1;
+    document_type doc {{}, sink, options, {}, {}, true};
+    doc.origin[src.data ()] = 0;
+    doc.holes = &holes;
+    split_lines (src.cbegin (), src.cend (), pass1, doc);
+    render_document (pass1, doc);
+    std::wstring const out = html.str ();
+    tmpl.piece.assign (1, std::wstring ());
+    tmpl.hole.clear ();
+    for (char_iterator s = out.cbegin (); s < out.cend (); ++s) {
+        if (! ismdhole (*s)) {
+            tmpl.piece.back ().push_back (*s);
+            continue;
+        }
+        std::size_t k = tmpl.hole.size ();
+        if (k >= holes.size () || holes[k].first != *s)
+            return false;
+        tmpl.hole.push_back ({holes[k].second, names[*s - 0xe000]});
+        tmpl.piece.push_back (std::wstring ());
+    }
+    return tmpl.hole.size () == holes.size ();
+}
+
+/* relative uris, or those of the schemes of autolinks */
+static bool
+isholeuri (std::wstring const& uri)
+{
+    std::size_t i = uri.find_first_of (L":/?#");
+    return std::wstring::npos == i || ':' != uri[i]
+        || match_uri (uri.cbegin (), uri.cend ());
+}
+
+void markdown_render (markdown_template const& tmpl,
+    std::map<std::wstring, std::wstring> const& values, std::wostream& output)
+{
+    for (std::size_t i = 0; i < tmpl.hole.size (); ++i) {
+        output << tmpl.piece[i];
+        auto v = values.find (tmpl.hole[i].name);
+        if (v == values.end ())
+            continue;
+        std::wstring const& value = v->second;
+        if (MDHOLE_NONE == tmpl.hole[i].kind)
+            continue;
+        if (MDHOLE_URI == tmpl.hole[i].kind) {
+            if (isholeuri (value))
+                print_with_escape_uri (value.cbegin (), value.cend (), output);
+        }
+        else
+            print_with_escape_htmlall (value.cbegin (), value.cend (), output);
+    }
+    output << tmpl.piece.back ();
 }
@@ -2,5 +2,245 @@
 
 #include <string>
 #include <ostream>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <chrono>
+
+/* link list entry kinds */
+enum markdown_link_kind {
+    MDLINK_ANCHOR,      // [text](uri)
+    MDLINK_IMAGE,       // ![alt](uri)
+    MDLINK_UNDEFINED,   // [text][id] without [id]: definition, uri is id
+    MDLINK_AUTOLINK,    // <uri>
+    MDLINK_ANCHORREF,   // [text][id]
+    MDLINK_IMAGEREF,    // ![alt][id]
+    MDLINK_UNUSED,      // [id]: uri referred from nowhere
+    MDLINK_WIKI,        // [[page]]
+    MDLINK_EXTENSION,   // @name of markdown_options::inlines resolved to uri
+};
+
+/* offset: position of the construct in the input, or of the !include
+ * line for the links of an included file
+ */
+struct markdown_link {
+    std::size_t offset;
+    int kind;
+    std::wstring uri;
+};
+
+struct markdown_heading {
+    int level;
+    std::wstring text;
+};
+
+/* key: value pairs between --- lines at the beginning of the input */
+struct markdown_frontmatter {
+    std::size_t size;       // of the front matter, rendering starts there
+    std::deque<std::pair<std::wstring, std::wstring>> field;
+};
+
+/* counts of a document, added to the current values */
+struct markdown_stats {
+    std::size_t words;      // except for han and kana
+    std::size_t cjk;        // han and kana characters
+    std::size_t headings;
+    std::size_t links;
+    std::size_t images;
+    std::size_t codeblocks;
+    std::size_t codelines;
+};
+
+/* at 200 words or 500 han and kana characters per minute */
+double markdown_reading_minutes (markdown_stats const& stats);
+
+/* stages timed by markdown_options::trace */
+enum markdown_stage {
+    MDSTAGE_SPLIT,      // split_lines
+    MDSTAGE_BLOCK,      // parse_block
+    MDSTAGE_PRINT,      // print_block, around MDSTAGE_INLINE
+    MDSTAGE_INLINE,     // parse_inline of a paragraph, a heading or an item
+};
+
+/* containers of the parser counted by markdown_sink::memory */
+enum markdown_alloc_kind {
+    MDALLOC_LINES,      // block tokens of split_lines
+    MDALLOC_BLOCKS,     // block tokens of parse_block and of nested blocks
+    MDALLOC_INLINES,    // inline tokens
+    MDALLOC_REFDICT,    // reference definitions
+    MDALLOC_STRINGS,    // temporaries of print_inline and print_with_escape_uri
+    MDALLOC_KINDS,
+};
+
+struct markdown_alloc {
+    std::size_t count;
+    std::size_t bytes;
+    std::size_t peak;       // of the live bytes of all the kinds
+};
+
+/* allocations added to the current values, with peaks of the largest
+ * document. a stage counts none of the stage nested in it.
+ */
+struct markdown_memory {
+    markdown_alloc kind[MDALLOC_KINDS];
+    markdown_alloc stage[MDSTAGE_INLINE + 1];
+    markdown_alloc total;
+    std::size_t live;       // not released yet, 0 after the documents end
+};
+
+/* work of the parser, added to the current values, with the deepest
+ * nesting of all the documents
+ */
+struct markdown_profile {
+    std::size_t depth;      // of nested blocks
+    std::size_t fallbacks;  // brackets of parse_link parsed again as text
+    std::size_t searched;   // characters searched for ends of fences and html
+    std::size_t delimiters; // runs of * and _
+};
+
+/* fan-out outputs of a single parse. null members are skipped. */
+struct markdown_sink {
+    std::wostream* html;
+    std::wostream* text;
+    std::deque<markdown_heading>* outline;
+    std::deque<markdown_link>* links;
+    /* recognizes front matter only when given, left as it is without it */
+    markdown_frontmatter* frontmatter;
+    markdown_stats* stats;
+    markdown_memory* memory;
+    markdown_profile* profile;
+};
+
+/* a block from an opening line to a closing line, or to the end of the
+ * enclosing block. lines keep their newlines.
+ */
+struct markdown_block_extension {
+    std::wstring leaders;   // first characters of opening lines after indents
+    std::function<bool (std::wstring const& line)> open;
+    std::function<bool (std::wstring const& first, std::wstring const& line)> close;
+    std::function<std::wstring (std::deque<std::wstring> const& lines)> render;
+};
+
+/* a trigger character followed by a name, such as @user or #1234 */
+struct markdown_inline_extension {
+    wchar_t trigger;
+    std::function<bool (wchar_t c)> isname;
+    /* called once per document with the distinct names, returns an uri
+     * for each of them, or an empty uri to leave the name as text.
+     */
+    std::function<std::deque<std::wstring> (std::deque<std::wstring> const& names)> resolve;
+};
+
+/* [[page]] and [[page|label]] links */
+struct markdown_wiki {
+    /* uri of a page, or the page itself when not given */
+    std::function<std::wstring (std::wstring const& page)> uri;
+    /* called once per document with the distinct pages, returns whether
+     * each of them exists. wiki links are recognized only when given.
+     */
+    std::function<std::deque<bool> (std::deque<std::wstring> const& pages)> exists;
+};
+
+/* parses of included files, shared by the documents of a batch */
+struct markdown_include_cache;
+std::shared_ptr<markdown_include_cache> markdown_make_include_cache ();
+
+/* !include path lines, replaced by the html of the file, and by its
+ * text, headings, links and counts in the other sinks. paths are
+ * relative to the including document. an included file is read once
+ * for the documents sharing the cache, and rendered once for each set
+ * of the options emoji, smart and math, of the block leaders and inline
+ * triggers, and of whether front matter, rewrite_uri and wiki are
+ * given. the documents sharing a cache must give the same hooks, which
+ * cannot be compared. a line including a file being included already
+ * or unreadable stays as text.
+ */
+struct markdown_include {
+    /* recognized only when given, returns false if it cannot read */
+    std::function<bool (std::string const& path, std::wstring& content)> read;
+    std::string path;       // of the document
+    std::shared_ptr<markdown_include_cache> cache;
+};
+
+struct markdown_options {
+    /* called once for each distinct uri of links or of images in a
+     * document, returns the uri to print instead.
+     */
+    std::function<std::wstring (std::wstring const& uri, bool image)> rewrite_uri;
+    /* tried in order before the built-in blocks */
+    std::deque<markdown_block_extension> blocks;
+    /* triggers other than markup characters */
+    std::deque<markdown_inline_extension> inlines;
+    /* :name: emoji shortcodes in texts */
+    bool emoji = false;
+    /* curly quotes, en and em dashes, and ellipses in texts */
+    bool smart = false;
+    /* $tex$ and $$tex$$ spans, and $$ blocks, escaped as they are */
+    bool math = false;
+    markdown_wiki wiki;
+    markdown_include include;
+    /* called on the rendering thread at the end of each stage */
+    std::function<void (int stage, std::chrono::steady_clock::time_point start,
+        std::chrono::steady_clock::time_point end)> trace;
+    /* called at the start of each stage, to measure it by other means */
+    std::function<void (int stage)> trace_enter;
+};
 
 void markdown (std::wstring const& input, std::wostream& output);
+void markdown (std::wstring const& input, markdown_sink const& sink);
+void markdown (std::wstring const& input, markdown_sink const& sink,
+    markdown_options const& options);
+
+/* input as a sequence of chunks, without concatenating them */
+void markdown (std::deque<std::wstring> const& chunks,
+    markdown_sink const& sink, markdown_options const& options);
+
+/* pull api: renders html on demand, a group of block tokens at a time,
+ * so that only the html of the current group is buffered. the names of
+ * inline extensions and wiki pages are resolved for each group. the
+ * input must outlive the reader.
+ */
+struct markdown_reader {
+    explicit markdown_reader (std::wstring const& input,
+        markdown_options const& options = markdown_options (),
+        markdown_memory* memory = nullptr);
+    ~markdown_reader ();
+    /* fills buf with up to size characters, returns 0 at the end */
+    std::size_t read (wchar_t* buf, std::size_t size);
+private:
+    struct state_type;
+    std::unique_ptr<state_type> state;
+};
+
+/* typed holes of a compiled template */
+enum markdown_hole_kind {
+    MDHOLE_TEXT,        // element contents
+    MDHOLE_ATTRIBUTE,   // title and alt attributes, or quoted values of raw html
+    MDHOLE_URI,         // href and src attributes
+    MDHOLE_NONE,        // names, unquoted values, event handlers and style
+                        // of raw html, left out
+};
+
+struct markdown_hole {
+    int kind;
+    std::wstring name;
+};
+
+/* piece[0] hole[0] piece[1] hole[1] ... piece[n] */
+struct markdown_template {
+    std::deque<std::wstring> piece;
+    std::deque<markdown_hole> hole;
+};
+
+/* {{name}} placeholders in the input become holes. returns false if
+ * the input contains private use characters U+E000..U+F8FF, or if the
+ * kind of a hole in the html is not known.
+ */
+bool markdown_compile (std::wstring const& input, markdown_template& tmpl);
+/* values of uri holes with other schemes than those of autolinks, such
+ * as javascript:, and of MDHOLE_NONE holes are left out like missing
+ * values.
+ */
+void markdown_render (markdown_template const& tmpl,
+    std::map<std::wstring, std::wstring> const& values, std::wostream& output);
@@ -0,0 +1,32 @@
+#pragma once
+
+/* helpers of mkdown shared with mkdown-kernels and mkdown-fuzz */
+#include <streambuf>
+#include <string>
+
+/* bytes of str in utf-8 */
+static inline std::size_t
+utf8_size (std::wstring const& str)
+{
+    std::size_t n = 0;
+    for (wchar_t c : str)
+        n += c < 0x80 ? 1 : c < 0x800 ? 2 : c < 0x10000 ? 3 : 4;
+    return n;
+}
+
+/* counts html without keeping it, through a buffer like a file has */
+struct nullbuf_type : std::wstreambuf {
+    wchar_t buf[4096];
+    std::size_t size;
+
+    nullbuf_type () : size (0) { setp (buf, buf + 4096); }
+
+    int_type overflow (int_type c)
+    {
+        size += pptr () - pbase ();
+        setp (buf, buf + 4096);
+        if (c != traits_type::eof ())
+            sputc (traits_type::to_char_type (c));
+        return traits_type::not_eof (c);
+    }
+};